@@ -0,0 +1,318 @@
+// Copyright (C) 2021-2022  ilobilo
+
+#include <drivers/display/terminal/terminal.hpp>
+#include <system/sched/scheduler/scheduler.hpp>
+#include <system/sched/hpet/hpet.hpp>
+#include <system/mm/pmm/pmm.hpp>
+#include <apps/allocbench.hpp>
+#include <kernel/kernel.hpp>
+#include <lib/liballoc.hpp>
+#include <lib/alloc.hpp>
+#include <lib/timer.hpp>
+#include <lib/math.hpp>
+#include <lib/cpu.hpp>
+#include <lib/log.hpp>
+
+using namespace kernel::system::sched;
+using namespace kernel::system::mm;
+using namespace kernel::system;
+
+namespace kernel::apps::allocbench {
+
+struct backend_t
+{
+    const char *name;
+    void *(*malloc)(size_t size);
+    void *(*realloc)(void *ptr, size_t size);
+    void (*free)(void *ptr);
+};
+
+static backend_t backends[]
+{
+    {
+        "LIBALLOC",
+        liballoc_malloc,
+        liballoc_realloc,
+        liballoc_free
+    },
+    {
+        "BUDDY",
+        [](size_t size) { return buddyheap.malloc(size); },
+        [](void *ptr, size_t size) { return buddyheap.realloc(ptr, size); },
+        [](void *ptr) { buddyheap.free(ptr); }
+    },
+    {
+        "SLAB",
+        [](size_t size) { return slabheap.malloc(size); },
+        [](void *ptr, size_t size) { return slabheap.realloc(ptr, size); },
+        [](void *ptr) { slabheap.free(ptr); }
+    }
+};
+
+enum workload_t
+{
+    MIX,
+    PRODCONS,
+    REALLOC
+};
+static const char *workload_names[] { "alloc/free mix", "producer/consumer", "realloc growth" };
+
+// Single producer, single consumer
+struct ring_t
+{
+    void *slots[bench_ring_size];
+    size_t head;
+    size_t tail;
+};
+
+struct worker_t
+{
+    backend_t *backend;
+    workload_t workload;
+    size_t id;
+    ring_t *ring;
+
+    size_t ops;
+    size_t nsamples;
+    uint64_t samples[bench_samples];
+};
+
+static size_t ready = 0;
+static size_t finished = 0;
+static bool go = false;
+
+static uint64_t tsc_per_ms = 0;
+
+static void print(const char *fmt, ...)
+{
+    char buffer[256];
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+
+    log("%s", buffer);
+    printf("%s\n", buffer);
+}
+
+static inline uint64_t xorshift(uint64_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+// Mostly small objects with a tail of medium and multi page ones
+static size_t random_size(uint64_t &state)
+{
+    uint64_t r = xorshift(state);
+    if (r % 20 == 0) return 2048 + (r >> 8) % 14336;
+    if (r % 20 <= 5) return 256 + (r >> 8) % 1792;
+    return 16 + (r >> 8) % 240;
+}
+
+static inline void record(worker_t *worker, uint64_t start)
+{
+    uint64_t time = rdtsc() - start;
+    if (worker->ops++ % DIV_ROUNDUP(bench_ops, bench_samples) == 0 && worker->nsamples < bench_samples) worker->samples[worker->nsamples++] = time;
+}
+
+static void worker(uint64_t arg)
+{
+    worker_t *worker = reinterpret_cast<worker_t*>(arg);
+    backend_t *backend = worker->backend;
+    uint64_t state = 0x9E3779B97F4A7C15 ^ ((worker->id + 1) * 0x100000001B3);
+
+    __atomic_add_fetch(&ready, 1, __ATOMIC_ACQ_REL);
+    while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE)) asm volatile ("pause");
+
+    switch (worker->workload)
+    {
+        case MIX:
+        {
+            void *slots[bench_slots] { };
+            for (size_t i = 0; i < bench_ops; i++)
+            {
+                void *&slot = slots[xorshift(state) % bench_slots];
+
+                uint64_t start = rdtsc();
+                if (slot != nullptr)
+                {
+                    backend->free(slot);
+                    slot = nullptr;
+                }
+                else slot = backend->malloc(random_size(state));
+                record(worker, start);
+            }
+            for (void *slot : slots) if (slot != nullptr) backend->free(slot);
+            break;
+        }
+        case PRODCONS:
+        {
+            // Even workers allocate, odd ones free what their partner allocated
+            ring_t *ring = worker->ring;
+            for (size_t i = 0; i < bench_ops; i++)
+            {
+                if (worker->id % 2 == 0)
+                {
+                    uint64_t start = rdtsc();
+                    void *ptr = backend->malloc(random_size(state));
+                    record(worker, start);
+
+                    while (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == bench_ring_size) asm volatile ("pause");
+                    ring->slots[ring->head % bench_ring_size] = ptr;
+                    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+                }
+                else
+                {
+                    while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail) asm volatile ("pause");
+                    void *ptr = ring->slots[ring->tail % bench_ring_size];
+                    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+
+                    uint64_t start = rdtsc();
+                    backend->free(ptr);
+                    record(worker, start);
+                }
+            }
+            break;
+        }
+        case REALLOC:
+        {
+            for (size_t i = 0; i < bench_ops;)
+            {
+                void *ptr = nullptr;
+                for (size_t size = 16; size < 0x10000 && i < bench_ops; size += size / 2 + 1, i++)
+                {
+                    uint64_t start = rdtsc();
+                    ptr = backend->realloc(ptr, size);
+                    record(worker, start);
+                }
+                backend->free(ptr);
+            }
+            break;
+        }
+    }
+
+    __atomic_add_fetch(&finished, 1, __ATOMIC_ACQ_REL);
+}
+
+// Quickselect, reorders samples
+static uint64_t nth(uint64_t *samples, int64_t count, int64_t n)
+{
+    int64_t lo = 0, hi = count - 1;
+    while (lo < hi)
+    {
+        uint64_t pivot = samples[(lo + hi) / 2];
+        int64_t i = lo, j = hi;
+        while (i <= j)
+        {
+            while (samples[i] < pivot) i++;
+            while (samples[j] > pivot) j--;
+            if (i <= j)
+            {
+                uint64_t tmp = samples[i];
+                samples[i++] = samples[j];
+                samples[j--] = tmp;
+            }
+        }
+        if (n <= j) hi = j;
+        else if (n >= i) lo = i;
+        else break;
+    }
+    return samples[n];
+}
+
+static void run_workload(backend_t *backend, workload_t workload, size_t count)
+{
+    worker_t *workers = calloc<worker_t*>(count, sizeof(worker_t));
+    ring_t *rings = calloc<ring_t*>(count / 2, sizeof(ring_t));
+
+    __atomic_store_n(&ready, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&finished, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&go, false, __ATOMIC_RELEASE);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        workers[i].backend = backend;
+        workers[i].workload = workload;
+        workers[i].id = i;
+        workers[i].ring = &rings[i / 2];
+        this_proc()->add_thread(worker, reinterpret_cast<uint64_t>(&workers[i]));
+    }
+
+    while (__atomic_load_n(&ready, __ATOMIC_ACQUIRE) < count) timer::msleep(1);
+    uint64_t start = hpet::nanos();
+    __atomic_store_n(&go, true, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < count) timer::msleep(1);
+    uint64_t time = hpet::nanos() - start;
+
+    size_t ops = 0, nsamples = 0;
+    for (size_t i = 0; i < count; i++) ops += workers[i].ops;
+
+    uint64_t *samples = malloc<uint64_t*>(count * bench_samples * sizeof(uint64_t));
+    for (size_t i = 0; i < count; i++)
+    {
+        for (size_t j = 0; j < workers[i].nsamples; j++) samples[nsamples++] = workers[i].samples[j];
+    }
+
+    uint64_t p99 = nsamples ? nth(samples, nsamples, nsamples * 99 / 100) : 0;
+    print("%-8s %-18s %10lu ops/s, p99 %6lu ns", backend->name, workload_names[workload], ops * 1000000000 / (time ? time : 1), p99 * 1000000 / tsc_per_ms);
+
+    free(samples);
+    free(rings);
+    free(workers);
+}
+
+// Footprint in frames of a fixed set of live allocations against the bytes asked for
+static void run_overhead(backend_t *backend)
+{
+    void **ptrs = calloc<void**>(bench_overhead_allocs, sizeof(void*));
+    uint64_t state = 0x2545F4914F6CDD1D;
+    size_t requested = 0;
+
+    size_t before = pmm::usedmem();
+    for (size_t i = 0; i < bench_overhead_allocs; i++)
+    {
+        size_t size = random_size(state);
+        requested += size;
+        ptrs[i] = backend->malloc(size);
+    }
+    size_t after = pmm::usedmem();
+    size_t used = (after > before) ? after - before : 0;
+
+    for (size_t i = 0; i < bench_overhead_allocs; i++) backend->free(ptrs[i]);
+    free(ptrs);
+
+    print("%-8s %8zu KiB requested, %8zu KiB of frames, %4ld%% overhead", backend->name, requested / 1024, used / 1024, static_cast<int64_t>(used * 100 / requested) - 100);
+}
+
+void run()
+{
+    if (!hpet::initialised)
+    {
+        print("Allocator benchmark: HPET is not available!");
+        return;
+    }
+
+    uint64_t start_ns = hpet::nanos();
+    uint64_t start_tsc = rdtsc();
+    timer::msleep(10);
+    tsc_per_ms = (rdtsc() - start_tsc) * 1000000 / (hpet::nanos() - start_ns);
+
+    // Producer/consumer needs pairs
+    size_t count = ALIGN_UP(smp_request.response->cpu_count, 2);
+
+    print("Allocator benchmark: %zu threads, %zu operations each, current heap is %s", count, bench_ops, backends[defalloc].name);
+    for (backend_t &backend : backends)
+    {
+        run_workload(&backend, MIX, count);
+        run_workload(&backend, PRODCONS, count);
+        run_workload(&backend, REALLOC, count);
+    }
+
+    print("Memory overhead of %zu live allocations:", bench_overhead_allocs);
+    for (backend_t &backend : backends) run_overhead(&backend);
+}
+}
\ No newline at end of file
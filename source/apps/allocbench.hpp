@@ -0,0 +1,18 @@
+// Copyright (C) 2021-2022  ilobilo
+
+#pragma once
+
+#include <cstddef>
+
+namespace kernel::apps::allocbench {
+
+static constexpr size_t bench_ops = 100000;
+static constexpr size_t bench_slots = 256;
+static constexpr size_t bench_ring_size = 1024;
+static constexpr size_t bench_samples = 4096;
+static constexpr size_t bench_overhead_allocs = 4096;
+
+// Runs every workload on every heap backend with one thread per CPU,
+// results go to both the terminal and the serial log
+void run();
+}
\ No newline at end of file
@@ -2,17 +2,25 @@
 
 #include <drivers/display/terminal/terminal.hpp>
 #include <system/sched/scheduler/scheduler.hpp>
+#include <system/mm/pagecache/pagecache.hpp>
 #include <drivers/fs/devfs/dev/tty.hpp>
 #include <system/sched/rtc/rtc.hpp>
+#include <system/sched/hpet/hpet.hpp>
 #include <system/sched/pit/pit.hpp>
+#include <system/cpu/smp/smp.hpp>
 #include <system/mm/pmm/pmm.hpp>
+#include <system/mm/vmm/vmm.hpp>
 #include <system/acpi/acpi.hpp>
 #include <drivers/ps2/ps2.hpp>
 #include <system/pci/pci.hpp>
+#include <apps/allocbench.hpp>
 #include <lib/shared_ptr.hpp>
+#include <lib/bitmap.hpp>
 #include <lib/string.hpp>
 #include <lib/memory.hpp>
+#include <lib/math.hpp>
 #include <lib/timer.hpp>
+#include <lib/slab.hpp>
 #include <lib/alloc.hpp>
 #include <lib/log.hpp>
 #include <lib/io.hpp>
@@ -29,6 +37,68 @@ namespace kernel::apps::kshell {
 
 vfs::fs_node_t *current_path = nullptr;
 
+// Byte at a time, bit by bit scan the old Bitmap did
+static int64_t legacy_first_clear(uint8_t *buffer, uint64_t size)
+{
+    for (uint64_t i = 0; i < size; i++)
+    {
+        if ((buffer[i / 8] & (0b10000000 >> (i % 8))) == 0) return i;
+    }
+    return -1;
+}
+
+static void bitmap_bench()
+{
+    if (!hpet::initialised)
+    {
+        printf("\033[31mHPET is not available!%s\n", terminal::resetcolour);
+        return;
+    }
+
+    // One bit per 4 KiB frame of 64 GiB
+    uint64_t bits = (64UL << 30) / 0x1000;
+    uint64_t pages = DIV_ROUNDUP(Bitmap::words(bits) * 8, 0x1000);
+    uint64_t sumpages = DIV_ROUNDUP(Bitmap::words(Bitmap::words(bits)) * 8, 0x1000);
+
+    uint8_t *buffer = pmm::alloc<uint8_t*>(pages, pmm::AllocNoZero);
+    uint8_t *summary = pmm::alloc<uint8_t*>(sumpages);
+
+    Bitmap bitmap;
+    bitmap.buffer = reinterpret_cast<uint64_t*>(buffer + hhdm_offset);
+    bitmap.size = bits;
+
+    bitmap.SetRange(0, bits, true);
+    bitmap.SetRange(bits - 512, 512, false);
+
+    uint64_t start = hpet::nanos();
+    int64_t legacy = legacy_first_clear(buffer + hhdm_offset, bits);
+    uint64_t legacy_time = hpet::nanos() - start;
+
+    start = hpet::nanos();
+    int64_t word = bitmap.FindFirstClear();
+    uint64_t word_time = hpet::nanos() - start;
+
+    bitmap.summary = reinterpret_cast<uint64_t*>(summary + hhdm_offset);
+    bitmap.BuildSummary();
+
+    start = hpet::nanos();
+    int64_t summed = bitmap.FindFirstClear();
+    uint64_t summed_time = hpet::nanos() - start;
+
+    start = hpet::nanos();
+    int64_t run = bitmap.FindClearRun(512);
+    uint64_t run_time = hpet::nanos() - start;
+
+    printf("Bitmap of %lu bits (%lu KB):\n", bits, pages * 4);
+    printf("- Bit by bit first clear: %ld in %lu ns\n", legacy, legacy_time);
+    printf("- Word first clear: %ld in %lu ns\n", word, word_time);
+    printf("- Word first clear with summary: %ld in %lu ns\n", summed, summed_time);
+    printf("- Run of 512 clear bits with summary: %ld in %lu ns\n", run, run_time);
+
+    pmm::free(buffer, pages);
+    pmm::free(summary, sumpages);
+}
+
 void parse(std::string cmd, std::string arg)
 {
     if (cmd.empty()) return;
@@ -42,6 +112,14 @@ void parse(std::string cmd, std::string arg)
             printf("- cd -- Change directory\n");
             printf("- exec -- Execute binary\n");
             printf("- free -- Get memory info\n");
+            printf("- buddyinfo -- Get free physical blocks per order\n");
+            printf("- pcpinfo -- Get per-CPU page frame cache statistics\n");
+            printf("- slabinfo -- Get slab and object cache statistics\n");
+            printf("- allocprof <rate> -- Get the allocation profile, or sample 1 in rate allocations (0 to stop)\n");
+            printf("- faultinfo -- Show page fault counters of each CPU\n");
+            printf("- sync -- Write dirty page cache pages back\n");
+            printf("- bitmapbench -- Compare bit by bit and word at a time bitmap scans\n");
+            printf("- allocbench -- Benchmark the heap allocators on all CPUs\n");
             printf("- time -- Get current RTC time\n");
             printf("- timef -- Get current RTC time (Forever loop)\n");
             printf("- tick -- Get current PIT tick\n");
@@ -173,8 +251,72 @@ void parse(std::string cmd, std::string arg)
             uint64_t used = pmm::usedmem() / 1024;
             uint64_t all = free + used;
             printf("Usable memory: %ld KB\nFree memory: %ld KB\nUsed memory: %ld KB\n", all, free, used);
+            printf("Page tables: %zu KB\n", vmm::tablepages() * 4);
+            printf("Page cache: %zu KB (%zu KB dirty)\n", pagecache::cachedpages() * 4, pagecache::dirtypages() * 4);
+            break;
+        }
+        case hash("buddyinfo"):
+            for (size_t i = 0; i < pmm::max_order; i++)
+            {
+                printf("Order %zu (%zu KB): %zu free blocks\n", i, (1UL << i) * 4, pmm::freeblocks(i));
+            }
+            printf("Pre-zeroed pages: %zu\n", pmm::zeroedpages());
+            printf("Reserved huge frames: %zu (2 MB), %zu (1 GB)\n", pmm::hugereserved(pmm::huge_2m_size), pmm::hugereserved(pmm::huge_1g_size));
+            break;
+        case hash("pcpinfo"):
+            for (size_t i = 0; i < smp_request.response->cpu_count; i++)
+            {
+                auto &mag = cpu::smp::cpus[i].frames;
+                printf("CPU %zu: %zu cached, alloc %zu/%zu, free %zu/%zu (hits/misses)\n", i, mag.count, mag.alloc_hits, mag.alloc_misses, mag.free_hits, mag.free_misses);
+            }
+            break;
+        case hash("faultinfo"):
+            for (size_t i = 0; i < smp_request.response->cpu_count; i++)
+            {
+                auto &faults = cpu::smp::cpus[i].faults;
+                printf("CPU %zu: %zu minor, %zu major, %zu copy on write\n", i, faults.minor, faults.major, faults.cow);
+            }
+            break;
+        case hash("sync"):
+            printf("Wrote back %zu pages\n", pagecache::sync());
+            break;
+        case hash("slabinfo"):
+            printf("%-20s %6s %6s %6s %4s %5s %7s %10s %10s\n", "Name", "Size", "Stride", "Objs", "Pgs", "Clrs", "Active", "Allocs", "Frees");
+            slab_foreach([](slab_t *slab)
+            {
+                if (slab->name != nullptr) printf("%-20s", slab->name);
+                else printf("size-%-15lu", slab->size);
+                printf(" %6lu %6zu %6zu %4zu %5zu %7zu %10zu %10zu\n", slab->size, slab->stride, slab->total, 1UL << slab->order, slab->colours, slab->allocs - slab->frees, slab->allocs, slab->frees);
+            });
+            break;
+        case hash("allocprof"):
+        {
+            if (!arg.empty())
+            {
+                // Only plain decimal rates, 0 stops sampling
+                bool number = true;
+                for (const char *c = arg.c_str(); *c != 0; c++) if (!isdigit(*c)) number = false;
+                if (!number)
+                {
+                    printf("allocprof <rate>\n");
+                    break;
+                }
+                allocprof_enable(strtol(arg.c_str(), nullptr, 10));
+                break;
+            }
+            size_t len = allocprof_report(nullptr, 0) + 1;
+            char *report = malloc<char*>(len);
+            allocprof_report(report, len);
+            printf("%s", report);
+            free(report);
             break;
         }
+        case hash("bitmapbench"):
+            bitmap_bench();
+            break;
+        case hash("allocbench"):
+            allocbench::run();
+            break;
         case hash("time"):
             printf("%s\n", rtc::getTime());
             break;
@@ -241,6 +383,8 @@ void run()
     log("Starting kernel shell\n");
 
     current_path = this_proc()->current_dir;
+    if (strstr(cmdline, "allocbench")) allocbench::run();
+
     while (true)
     {
         printf("\033[32mroot@kernel\033[0m:\033[95m%s%s%s# ", (current_path->name.first() != '/') ? "/" : "", current_path->name.c_str(), terminal::resetcolour);
@@ -99,15 +99,15 @@ bool AHCIPort::rw(uint64_t sector, uint32_t sectorCount, uint8_t *buffer, bool w
     for (; i < cmdHdr->PRDTLength - 1; i++)
     {
         cmdtable->PRDTEntry[i].DataBaseAddress = static_cast<uint32_t>(reinterpret_cast<uint64_t>(buffer));
-        cmdtable->PRDTEntry[i].DataBaseAddressUpper = static_cast<uint32_t>(reinterpret_cast<uint64_t>(buffer) << 32);
+        cmdtable->PRDTEntry[i].DataBaseAddressUpper = static_cast<uint32_t>(reinterpret_cast<uint64_t>(buffer) >> 32);
         cmdtable->PRDTEntry[i].ByteCount = 0x2000 - 1;
         cmdtable->PRDTEntry[i].InterruptOnCompletion = 1;
-        buffer += 0x1000;
+        buffer += 0x2000;
         sectorCount -= 16;
     }
 
     cmdtable->PRDTEntry[i].DataBaseAddress = static_cast<uint32_t>(reinterpret_cast<uint64_t>(buffer));
-    cmdtable->PRDTEntry[i].DataBaseAddressUpper = static_cast<uint32_t>(reinterpret_cast<uint64_t>(buffer) << 32);
+    cmdtable->PRDTEntry[i].DataBaseAddressUpper = static_cast<uint32_t>(reinterpret_cast<uint64_t>(buffer) >> 32);
     cmdtable->PRDTEntry[i].ByteCount = (sectorCount << 9) - 1;
     cmdtable->PRDTEntry[i].InterruptOnCompletion = 1;
     // if (this->portType == SATAPI)
@@ -292,19 +292,24 @@ AHCIPort::AHCIPort(HBAPort *hbaport, size_t portNum)
 
     stopCMD();
 
-    void *newbase = malloc(1024);
+    // Command list (1 KiB, 1 KiB aligned) and received FIS area (256 bytes, 256 byte aligned) share a page
+    uint8_t *newbase = pmm::alloc_constrained<uint8_t*>(1, pmm::dma32_limit);
+    assert(newbase != nullptr, "AHCI: Could not allocate DMA memory!");
     this->hbaport->CommandListBase = static_cast<uint32_t>(reinterpret_cast<uint64_t>(newbase));
     this->hbaport->CommandListBaseUpper = static_cast<uint32_t>(reinterpret_cast<uint64_t>(newbase) >> 32);
 
-    void *fisBase = malloc(256);
+    uint8_t *fisBase = newbase + 1024;
     this->hbaport->FISBaseAddress = static_cast<uint32_t>(reinterpret_cast<uint64_t>(fisBase));
     this->hbaport->FISBaseAddressUpper = static_cast<uint32_t>(reinterpret_cast<uint64_t>(fisBase) >> 32);
 
+    // 32 command tables with 8 PRDT entries each, 256 bytes apiece
+    uint8_t *cmdTableAddr = pmm::alloc_constrained<uint8_t*>(2, pmm::dma32_limit);
+    assert(cmdTableAddr != nullptr, "AHCI: Could not allocate DMA memory!");
+
     HBACommandHeader *commandHdr = reinterpret_cast<HBACommandHeader*>(this->hbaport->CommandListBase + (static_cast<uint64_t>(this->hbaport->CommandListBaseUpper) << 32));
     for (size_t i = 0; i < 32; i++)
     {
         commandHdr[i].PRDTLength = 8;
-        void *cmdTableAddr = malloc(256);
         uint64_t address = reinterpret_cast<uint64_t>(cmdTableAddr) + (i << 8);
         commandHdr[i].CommandTableBaseAddress = static_cast<uint32_t>(address);
         commandHdr[i].CommandTableBaseAddressUpper = static_cast<uint32_t>(static_cast<uint64_t>(address) >> 32);
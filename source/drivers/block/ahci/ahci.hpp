@@ -6,6 +6,7 @@
 #include <system/mm/pmm/pmm.hpp>
 #include <system/pci/pci.hpp>
 #include <kernel/kernel.hpp>
+#include <lib/math.hpp>
 #include <lib/lock.hpp>
 #include <cstdint>
 
@@ -14,6 +15,9 @@ using namespace kernel::system;
 
 namespace kernel::drivers::block::ahci {
 
+// Each command table has room for 8 PRDT entries of 16 sectors
+static constexpr size_t AHCI_MAX_SECTORS = 128;
+
 enum status
 {
     ATA_DEV_BUSY = 0x80,
@@ -330,7 +334,7 @@ class AHCIPort : public drivemgr::Drive
 
     void irq_handler();
 
-    int64_t read(void *handle, uint8_t *buffer, uint64_t offset, uint64_t size)
+    int64_t rawread(uint8_t *buffer, uint64_t offset, uint64_t size)
     {
         if (offset % this->stat.blksize || size % this->stat.blksize)
         {
@@ -340,21 +344,31 @@ class AHCIPort : public drivemgr::Drive
 
         uint64_t start = offset / this->stat.blksize;
         uint64_t count = size / this->stat.blksize;
-        uint8_t *abuffer = pmm::alloc<uint8_t*>(count) + hhdm_offset;
-
-        if (!this->rw(start, count, abuffer, false))
+        uint64_t pages = DIV_ROUNDUP(size, 0x1000);
+        uint8_t *pbuffer = pmm::alloc_constrained<uint8_t*>(pages, pmm::dma32_limit, 0x1000, 0, pmm::AllocNoZero);
+        if (pbuffer == nullptr)
         {
-            errno_set(EIO);
-            pmm::free(abuffer - hhdm_offset);
+            errno_set(ENOMEM);
             return -1;
         }
-        memcpy(buffer, abuffer, size);
 
-        pmm::free(abuffer - hhdm_offset);
+        for (uint64_t done = 0; done < count; done += AHCI_MAX_SECTORS)
+        {
+            uint64_t chunk = (count - done < AHCI_MAX_SECTORS) ? count - done : AHCI_MAX_SECTORS;
+            if (!this->rw(start + done, chunk, pbuffer + done * this->stat.blksize, false))
+            {
+                errno_set(EIO);
+                pmm::free(pbuffer, pages);
+                return -1;
+            }
+        }
+        memcpy(buffer, pbuffer + hhdm_offset, size);
+
+        pmm::free(pbuffer, pages);
         return size;
     }
 
-    int64_t write(void *handle, uint8_t *buffer, uint64_t offset, uint64_t size)
+    int64_t rawwrite(uint8_t *buffer, uint64_t offset, uint64_t size)
     {
         if (offset % this->stat.blksize || size % this->stat.blksize)
         {
@@ -364,17 +378,27 @@ class AHCIPort : public drivemgr::Drive
 
         uint64_t start = offset / this->stat.blksize;
         uint64_t count = size / this->stat.blksize;
-        uint8_t *abuffer = pmm::alloc<uint8_t*>(count) + hhdm_offset;
-
-        memcpy(abuffer, buffer, size);
-        if (!this->rw(start, count, abuffer, true))
+        uint64_t pages = DIV_ROUNDUP(size, 0x1000);
+        uint8_t *pbuffer = pmm::alloc_constrained<uint8_t*>(pages, pmm::dma32_limit, 0x1000, 0, pmm::AllocNoZero);
+        if (pbuffer == nullptr)
         {
-            errno_set(EIO);
-            pmm::free(abuffer - hhdm_offset);
+            errno_set(ENOMEM);
             return -1;
         }
 
-        pmm::free(abuffer - hhdm_offset);
+        memcpy(pbuffer + hhdm_offset, buffer, size);
+        for (uint64_t done = 0; done < count; done += AHCI_MAX_SECTORS)
+        {
+            uint64_t chunk = (count - done < AHCI_MAX_SECTORS) ? count - done : AHCI_MAX_SECTORS;
+            if (!this->rw(start + done, chunk, pbuffer + done * this->stat.blksize, true))
+            {
+                errno_set(EIO);
+                pmm::free(pbuffer, pages);
+                return -1;
+            }
+        }
+
+        pmm::free(pbuffer, pages);
         return size;
     }
 
@@ -164,8 +164,9 @@ ATAPort::ATAPort(uint16_t port, uint16_t bmport, uint16_t ctrlport0, size_t driv
     else this->sectors = this->sectors = *reinterpret_cast<uint64_t*>(&identify[ATA_IDENT_MAX_LBA_EXT]);
 
     this->buffer = pmm::alloc<uint8_t*>(2);
-    this->prdt = pmm::alloc<uint64_t*>(2);
-    this->prdtBuffer = pmm::alloc<uint64_t*>(2);
+    this->prdt = pmm::alloc_constrained<uint64_t*>(1, pmm::dma32_limit, 0x1000, 0x10000);
+    this->prdtBuffer = pmm::alloc_constrained<uint64_t*>(1, pmm::dma32_limit, 0x1000, 0x10000);
+    assert(this->prdt != nullptr && this->prdtBuffer != nullptr, "ATA: Could not allocate DMA memory!");
 
     *this->prdt = (reinterpret_cast<uint64_t>(this->prdtBuffer) | (static_cast<uint64_t>(0x1000) << 32) | 0x8000000000000000ULL) & 0xFFFFFFFF;
 
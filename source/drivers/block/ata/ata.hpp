@@ -110,7 +110,7 @@ class ATAPort : public drivemgr::Drive
     bool initialised = false;
     ATAPortType portType;
 
-    int64_t read(void *handle, uint8_t *buffer, uint64_t offset, uint64_t size)
+    int64_t rawread(uint8_t *buffer, uint64_t offset, uint64_t size)
     {
         if (offset % this->stat.blksize || size % this->stat.blksize)
         {
@@ -149,7 +149,7 @@ class ATAPort : public drivemgr::Drive
         return size;
     }
 
-    int64_t write(void *handle, uint8_t *buffer, uint64_t offset, uint64_t size)
+    int64_t rawwrite(uint8_t *buffer, uint64_t offset, uint64_t size)
     {
         if (offset % this->stat.blksize || size % this->stat.blksize)
         {
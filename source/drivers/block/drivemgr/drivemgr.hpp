@@ -2,6 +2,7 @@
 
 #pragma once
 
+#include <system/mm/pagecache/pagecache.hpp>
 #include <system/vfs/vfs.hpp>
 #include <lib/string.hpp>
 #include <lib/vector.hpp>
@@ -96,6 +97,38 @@ struct Drive : vfs::resource_t
     vector<Partition*> partitions;
     uint64_t sectors;
     type_t type;
+
+    // Block aligned transfers straight to and from the device
+    virtual int64_t rawread(uint8_t *buffer, uint64_t offset, uint64_t size) = 0;
+    virtual int64_t rawwrite(uint8_t *buffer, uint64_t offset, uint64_t size) = 0;
+
+    // Everything else goes through the page cache, writes reach the disk on sync
+    int64_t read(void *handle, uint8_t *buffer, uint64_t offset, uint64_t size)
+    {
+        return mm::pagecache::read(this, buffer, offset, size);
+    }
+
+    int64_t write(void *handle, uint8_t *buffer, uint64_t offset, uint64_t size)
+    {
+        if (offset >= this->length()) return 0;
+        if (offset + size > this->length()) size = this->length() - offset;
+        return mm::pagecache::write(this, buffer, offset, size);
+    }
+
+    uint64_t length()
+    {
+        return this->sectors * this->stat.blksize;
+    }
+
+    bool readpage(uint64_t offset, uint8_t *buffer, uint64_t size)
+    {
+        return this->rawread(buffer, offset, size) == static_cast<int64_t>(size);
+    }
+
+    bool writepage(uint64_t offset, uint8_t *buffer, uint64_t size)
+    {
+        return this->rawwrite(buffer, offset, size) == static_cast<int64_t>(size);
+    }
 };
 
 struct Partition : vfs::resource_t
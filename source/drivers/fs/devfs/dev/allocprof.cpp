@@ -0,0 +1,95 @@
+// Copyright (C) 2021-2022  ilobilo
+
+#include <drivers/fs/devfs/dev/allocprof.hpp>
+#include <drivers/fs/devfs/devfs.hpp>
+#include <kernel/kernel.hpp>
+#include <lib/string.hpp>
+#include <lib/memory.hpp>
+#include <lib/alloc.hpp>
+#include <lib/log.hpp>
+
+namespace kernel::drivers::fs::dev::allocprof {
+
+bool initialised = false;
+
+// Reads return the current report
+int64_t allocprof_res::read(void *handle, uint8_t *buffer, uint64_t offset, uint64_t size)
+{
+    size_t len = allocprof_report(nullptr, 0) + 1;
+    char *report = malloc<char*>(len);
+    len = allocprof_report(report, len);
+
+    int64_t ret = 0;
+    if (offset < len)
+    {
+        ret = (offset + size > len) ? len - offset : size;
+        memcpy(buffer, report + offset, ret);
+    }
+
+    free(report);
+    return ret;
+}
+
+// Writing a number sets the sampling rate, 0 stops sampling
+int64_t allocprof_res::write(void *handle, uint8_t *buffer, uint64_t offset, uint64_t size)
+{
+    char str[32] { };
+    memcpy(str, buffer, (size < sizeof(str) - 1) ? size : sizeof(str) - 1);
+    allocprof_enable(strtol(str, nullptr, 10));
+    return size;
+}
+
+int allocprof_res::ioctl(void *handle, uint64_t request, void *argp)
+{
+    return vfs::default_ioctl(handle, request, argp);
+}
+
+bool allocprof_res::grow(void *handle, size_t new_size)
+{
+    return false;
+}
+
+void allocprof_res::unref(void *handle)
+{
+    this->refcount--;
+}
+
+void allocprof_res::link(void *handle)
+{
+    this->stat.nlink++;
+}
+
+void allocprof_res::unlink(void *handle)
+{
+    this->stat.nlink--;
+}
+
+void *allocprof_res::mmap(uint64_t page, int flags)
+{
+    return nullptr;
+}
+
+void init()
+{
+    if (initialised) return;
+
+    allocprof_res *res = new allocprof_res;
+
+    res->stat.size = 0;
+    res->stat.blocks = 0;
+    res->stat.blksize = 0x1000;
+    res->stat.rdev = vfs::dev_new_id();
+    res->stat.mode = 0644 | vfs::ifchr;
+
+    devfs::add(res, "allocprof");
+
+    const char *arg = strstr(cmdline, "allocprof=");
+    if (arg != nullptr)
+    {
+        allocprof_enable(strtol(arg + strlen("allocprof="), nullptr, 10));
+        log("Allocation profiler: Sampling 1 in %zu allocations", allocprof_rate());
+    }
+
+    initialised = true;
+}
+}
\ No newline at end of file
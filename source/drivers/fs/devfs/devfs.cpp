@@ -1,5 +1,6 @@
 // Copyright (C) 2021-2022  ilobilo
 
+#include <drivers/fs/devfs/dev/allocprof.hpp>
 #include <drivers/fs/devfs/dev/random.hpp>
 #include <drivers/fs/devfs/dev/null.hpp>
 #include <drivers/fs/devfs/dev/zero.hpp>
@@ -121,7 +122,7 @@ void *devfs_res::mmap(uint64_t page, int flags)
         return reinterpret_cast<void*>(reinterpret_cast<uint64_t>(&this->storage[page * vmm::page_size]) - hhdm_offset);
     }
 
-    void *copy = pmm::alloc();
+    void *copy = pmm::alloc(1, pmm::AllocNoZero);
     memcpy(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(copy) + hhdm_offset), &this->storage[page * vmm::page_size], vmm::page_size);
 
     return copy;
@@ -247,6 +248,7 @@ void init()
     dev::null::init();
     dev::zero::init();
     dev::tty::init();
+    dev::allocprof::init();
 
     serial::newline();
     initialised = true;
@@ -1,5 +1,6 @@
 // Copyright (C) 2021-2022  ilobilo
 
+#include <system/mm/pagecache/pagecache.hpp>
 #include <drivers/fs/tmpfs/tmpfs.hpp>
 #include <system/sched/rtc/rtc.hpp>
 #include <system/mm/pmm/pmm.hpp>
@@ -23,41 +24,21 @@ int64_t tmpfs_res::read(void *handle, uint8_t *buffer, uint64_t offset, uint64_t
 {
     lockit(this->lock);
 
-    uint64_t actual_size = size;
-    if (offset + size > static_cast<uint64_t>(this->stat.size))
-    {
-        actual_size = size - ((offset + size) - this->stat.size);
-    }
-    memcpy(buffer, this->storage + offset, actual_size);
-
-    return actual_size;
+    return pagecache::read(this, buffer, offset, size);
 }
 
 int64_t tmpfs_res::write(void *handle, uint8_t *buffer, uint64_t offset, uint64_t size)
 {
     lockit(this->lock);
 
-    if (offset + size > this->cap)
-    {
-        uint64_t new_cap = this->cap;
-        while (offset + size > new_cap) new_cap *= 2;
-
-        uint8_t *new_storage = realloc<uint8_t*>(this->storage, new_cap);
-        if (new_storage == nullptr || new_storage == this->storage) return 0;
-
-        this->storage = new_storage;
-        this->cap = new_cap;
-    }
-
-    memcpy(this->storage + offset, buffer, size);
-
-    if (offset + size > static_cast<uint64_t>(this->stat.size))
+    int64_t ret = pagecache::write(this, buffer, offset, size);
+    if (ret > 0 && offset + ret > static_cast<uint64_t>(this->stat.size))
     {
-        this->stat.size = offset + size;
+        this->stat.size = offset + ret;
         this->stat.blocks = DIV_ROUNDUP(this->stat.size, this->stat.blksize);
     }
 
-    return size;
+    return ret;
 }
 
 int tmpfs_res::ioctl(void *handle, uint64_t request, void *argp)
@@ -69,14 +50,9 @@ bool tmpfs_res::grow(void *handle, size_t new_size)
 {
     lockit(this->lock);
 
-    uint64_t new_cap = this->cap;
-    while (new_size > new_cap) new_cap *= 2;
-
-    uint8_t *new_storage = realloc<uint8_t*>(this->storage, new_cap);
-    if (new_storage == nullptr || new_storage == this->storage) return false;
-
-    this->storage = new_storage;
-    this->cap = new_cap;
+    // Whatever was past the old end, through a shared mapping, must read back as zeroes
+    uint64_t old_size = this->stat.size;
+    pagecache::truncate(this, (new_size < old_size) ? new_size : old_size);
 
     this->stat.size = new_size;
     this->stat.blocks = DIV_ROUNDUP(new_size, this->stat.blksize);
@@ -91,7 +67,7 @@ void tmpfs_res::unref(void *handle)
     this->refcount--;
     if (this->refcount == 0 && vfs::isreg(this->stat.mode))
     {
-        free(this->storage);
+        pagecache::invalidate(this);
         free(this);
     }
 }
@@ -110,19 +86,22 @@ void tmpfs_res::unlink(void *handle)
     this->stat.nlink--;
 }
 
+// No resource lock, faults on a read or write buffer would take it again
 void *tmpfs_res::mmap(uint64_t page, int flags)
 {
-    lockit(this->lock);
-
-    if (flags & vmm::MapShared)
-    {
-        return reinterpret_cast<void*>(reinterpret_cast<uint64_t>(&this->storage[page * vmm::page_size]) - hhdm_offset);
-    }
+    return pagecache::mmap(this, page, flags);
+}
 
-    void *copy = pmm::alloc();
-    memcpy(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(copy) + hhdm_offset), &this->storage[page * vmm::page_size], vmm::page_size);
+// The cache is the only copy, fresh pages are already zeroed
+bool tmpfs_res::readpage(uint64_t offset, uint8_t *buffer, uint64_t size)
+{
+    return true;
+}
 
-    return copy;
+// Nowhere to write to, so pages stay dirty and are never evicted
+bool tmpfs_res::writepage(uint64_t offset, uint8_t *buffer, uint64_t size)
+{
+    return false;
 }
 
 void tmpfs_fs::init() { }
@@ -163,9 +142,8 @@ vfs::fs_node_t *tmpfs_fs::create(vfs::fs_node_t *parent, std::string name, int m
 
     if (vfs::isreg(mode))
     {
-        res->cap = 0x1000;
-        res->storage = malloc<uint8_t*>(0x1000);
         res->can_mmap = true;
+        res->cached = true;
     }
 
     res->stat.size = 0;
@@ -23,9 +23,6 @@ struct tmpfs_fs : vfs::filesystem_t
 
 struct tmpfs_res : vfs::resource_t
 {
-    uint8_t *storage;
-    uint64_t cap;
-
     int64_t read(void *handle, uint8_t *buffer, uint64_t offset, uint64_t size);
     int64_t write(void *handle, uint8_t *buffer, uint64_t offset, uint64_t size);
     int ioctl(void *handle, uint64_t request, void *argp);
@@ -34,6 +31,8 @@ struct tmpfs_res : vfs::resource_t
     void link(void *handle);
     void unlink(void *handle);
     void *mmap(uint64_t page, int flags);
+    bool readpage(uint64_t offset, uint8_t *buffer, uint64_t size);
+    bool writepage(uint64_t offset, uint8_t *buffer, uint64_t size);
 };
 
 extern bool initialised;
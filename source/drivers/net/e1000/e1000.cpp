@@ -2,12 +2,16 @@
 
 #include <system/net/ethernet/ethernet.hpp>
 #include <drivers/net/e1000/e1000.hpp>
+#include <system/mm/pmm/pmm.hpp>
 #include <lib/shared_ptr.hpp>
 #include <lib/memory.hpp>
+#include <lib/panic.hpp>
+#include <lib/math.hpp>
 #include <lib/mmio.hpp>
 #include <lib/log.hpp>
 
 using namespace kernel::system::net;
+using namespace kernel::system::mm;
 
 namespace kernel::drivers::net::e1000 {
 
@@ -127,9 +131,14 @@ void E1000::send(void *data, uint64_t length)
 {
     lockit(this->lock);
 
-    std::shared_ptr<uint8_t> tdata(new uint8_t[length]);
-    memcpy(tdata.get(), data, length);
-    this->txdescs[this->txcurr]->addr = reinterpret_cast<uint64_t>(tdata.get());
+    if (length > E1000_TX_BUFF_SIZE)
+    {
+        if (this->debug) error("E1000: Packet is too big!");
+        return;
+    }
+
+    memcpy(this->txbuffers[this->txcurr], data, length);
+    this->txdescs[this->txcurr]->addr = reinterpret_cast<uint64_t>(this->txbuffers[this->txcurr]);
     this->txdescs[this->txcurr]->length = length;
     this->txdescs[this->txcurr]->cmd = CMD_EOP | CMD_IFCS | CMD_RS;
     this->txdescs[this->txcurr]->status = 0;
@@ -170,12 +179,15 @@ void E1000::receive()
 
 void E1000::rxinit()
 {
-    uint8_t *ptr = new uint8_t[E1000_NUM_RX_DESC + 1];
+    uint8_t *ptr = pmm::alloc_constrained<uint8_t*>(DIV_ROUNDUP(E1000_NUM_RX_DESC * sizeof(RXDesc), 0x1000), pmm::dma32_limit);
+    assert(ptr != nullptr, "E1000: Could not allocate RX descriptors!");
+
     RXDesc *descs = reinterpret_cast<RXDesc*>(ptr);
     for (size_t i = 0; i < E1000_NUM_RX_DESC; i++)
     {
         this->rxdescs[i] = reinterpret_cast<RXDesc*>(reinterpret_cast<uint8_t*>(descs) + i * 16);
-        this->rxdescs[i]->addr = malloc<uint64_t>(E1000_RX_BUFF_SIZE + 16);
+        this->rxdescs[i]->addr = pmm::alloc_constrained<uint64_t>(E1000_RX_BUFF_SIZE / 0x1000, pmm::dma32_limit, 0x1000, 0, pmm::AllocNoZero);
+        assert(this->rxdescs[i]->addr != 0, "E1000: Could not allocate RX buffers!");
         this->rxdescs[i]->status = 0;
     }
     this->outcmd(REG_RXDESCLO, reinterpret_cast<uint64_t>(ptr));
@@ -189,10 +201,15 @@ void E1000::rxinit()
 
 void E1000::txinit()
 {
-    uint8_t *ptr = new uint8_t[E1000_NUM_RX_DESC + 1];
+    uint8_t *ptr = pmm::alloc_constrained<uint8_t*>(DIV_ROUNDUP(E1000_NUM_TX_DESC * sizeof(TXDesc), 0x1000), pmm::dma32_limit);
+    assert(ptr != nullptr, "E1000: Could not allocate TX descriptors!");
+
     TXDesc *descs = reinterpret_cast<TXDesc*>(ptr);
     for (size_t i = 0; i < E1000_NUM_TX_DESC; i++)
     {
+        this->txbuffers[i] = pmm::alloc_constrained<uint8_t*>(E1000_TX_BUFF_SIZE / 0x1000, pmm::dma32_limit, 0x1000, 0, pmm::AllocNoZero);
+        assert(this->txbuffers[i] != nullptr, "E1000: Could not allocate TX buffers!");
+
         this->txdescs[i] = reinterpret_cast<TXDesc*>(reinterpret_cast<uint8_t*>(descs) + i * 16);
         this->txdescs[i]->addr = 0;
         this->txdescs[i]->cmd = 0;
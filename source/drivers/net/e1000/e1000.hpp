@@ -100,6 +100,7 @@ static constexpr uint8_t E1000_NUM_RX_DESC = 32;
 static constexpr uint8_t E1000_NUM_TX_DESC = 8;
 
 static constexpr uint32_t E1000_RX_BUFF_SIZE = 8192;
+static constexpr uint32_t E1000_TX_BUFF_SIZE = 4096;
 
 struct [[gnu::packed]] RXDesc
 {
@@ -134,6 +135,7 @@ class E1000 : public nicmgr::NIC
 
     RXDesc *rxdescs[E1000_NUM_RX_DESC];
     TXDesc *txdescs[E1000_NUM_TX_DESC];
+    uint8_t *txbuffers[E1000_NUM_TX_DESC];
     uint16_t rxcurr = 0;
     uint16_t txcurr = 0;
 
@@ -2,11 +2,15 @@
 
 #include <system/net/ethernet/ethernet.hpp>
 #include <drivers/net/rtl8139/rtl8139.hpp>
+#include <system/mm/pmm/pmm.hpp>
 #include <lib/shared_ptr.hpp>
 #include <lib/memory.hpp>
+#include <lib/panic.hpp>
+#include <lib/math.hpp>
 #include <lib/log.hpp>
 
 using namespace kernel::system::net;
+using namespace kernel::system::mm;
 
 namespace kernel::drivers::net::rtl8139 {
 
@@ -93,9 +97,15 @@ void RTL8139::send(void *data, uint64_t length)
 {
     lockit(this->lock);
 
-    std::shared_ptr<uint8_t> tdata(new uint8_t[length]);
-    memcpy(tdata.get(), data, length);
-    this->outl(this->TSAD[this->txcurr], static_cast<uint32_t>(reinterpret_cast<uint64_t>(tdata.get())));
+    if (length > RTL8139_TX_BUFF_SIZE)
+    {
+        if (this->debug) error("RTL8139: Packet is too big!");
+        return;
+    }
+
+    uint8_t *tdata = this->TXBuffer + this->txcurr * RTL8139_TX_BUFF_SIZE;
+    memcpy(tdata, data, length);
+    this->outl(this->TSAD[this->txcurr], static_cast<uint32_t>(reinterpret_cast<uint64_t>(tdata)));
     this->outl(this->TSD[this->txcurr++], length);
     if (this->txcurr > 3) this->txcurr = 0;
 }
@@ -127,7 +137,10 @@ void RTL8139::start()
 
     reset();
 
-    RXBuffer = malloc<uint8_t*>(8192 + 16 + 1500);
+    // The chip only takes 32-bit buffer addresses
+    RXBuffer = pmm::alloc_constrained<uint8_t*>(DIV_ROUNDUP(RTL8139_RX_BUFF_SIZE, 0x1000), pmm::dma32_limit);
+    TXBuffer = pmm::alloc_constrained<uint8_t*>(DIV_ROUNDUP(RTL8139_TX_BUFF_SIZE * 4, 0x1000), pmm::dma32_limit, 0x1000, 0, pmm::AllocNoZero);
+    assert(RXBuffer != nullptr && TXBuffer != nullptr, "RTL8139: Could not allocate DMA memory!");
     this->outl(REG_RBSTART, static_cast<uint32_t>(reinterpret_cast<uint64_t>(RXBuffer)));
 
     this->outw(REG_IMR, IMR_RECEIVE_OK | IMR_RECEIVE_ERROR | IMR_TRANSMIT_OK | IMR_TRANSMIT_ERROR | IMR_RX_OVERFLOW | IMR_LINK_CHANGE | IMR_RX_FIFO_OVERFLOW | IMR_CABLE_LENGTH_CHANGE | IMR_TIME_OUT | IMR_SYSTEM_ERROR);
@@ -84,6 +84,9 @@ enum rxconf
     RCR_WRAP = (1 << 7),
 };
 
+static constexpr uint32_t RTL8139_RX_BUFF_SIZE = 8192 + 16 + 1500;
+static constexpr uint32_t RTL8139_TX_BUFF_SIZE = 2048;
+
 class RTL8139 : public nicmgr::NIC
 {
     private:
@@ -95,6 +98,7 @@ class RTL8139 : public nicmgr::NIC
     uint64_t MEMBase = 0;
 
     uint8_t *RXBuffer = nullptr;
+    uint8_t *TXBuffer = nullptr;
     uint32_t current_packet = 0;
 
     uint8_t TSAD[4] = { REG_TSAD_0, REG_TSAD_1, REG_TSAD_2, REG_TSAD_3 };
@@ -5,6 +5,7 @@
 #include <drivers/display/terminal/terminal.hpp>
 #include <system/sched/scheduler/scheduler.hpp>
 #include <drivers/block/drivemgr/drivemgr.hpp>
+#include <system/mm/pagecache/pagecache.hpp>
 #include <drivers/net/rtl8139/rtl8139.hpp>
 #include <drivers/net/rtl8169/rtl8169.hpp>
 #include <system/cpu/syscall/syscall.hpp>
@@ -109,7 +110,9 @@ void main()
     serial::newline();
 
     terminal::check("Initialising PMM...", pmm::init, -1, pmm::initialised);
+    alloc_init();
     terminal::check("Initialising VMM...", vmm::init, -1, vmm::initialised);
+    terminal::check("Initialising Page Cache...", pagecache::init, -1, pagecache::initialised);
     constructors_init();
 
     terminal::check("Initialising GDT...", gdt::init, -1, gdt::initialised);
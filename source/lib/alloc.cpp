@@ -1,10 +1,40 @@
+#include <drivers/display/terminal/terminal.hpp>
+#include <system/cpu/smp/smp.hpp>
+#include <system/trace/trace.hpp>
+#include <kernel/kernel.hpp>
+#include <lib/string.hpp>
+#include <lib/log.hpp>
+#include <lib/memory.hpp>
 #include <lib/alloc.hpp>
 #include <lib/math.hpp>
+#include <lib/cpu.hpp>
+
+using namespace kernel::system::cpu;
+using namespace kernel::system;
 
 BuddyAlloc buddyheap;
 SlabAlloc slabheap;
 
-void *malloc(size_t size)
+allocs defalloc = SLAB;
+
+static size_t prof_rate = 0;
+static size_t prof_counter = 0;
+static size_t prof_dropped = 0;
+
+static allocsite_t prof_sites[allocprof_max_sites];
+
+struct tracked_t
+{
+    uint64_t ptr;
+    size_t site;
+    size_t sizeclass;
+};
+static tracked_t prof_tracked[allocprof_max_tracked];
+static size_t prof_tracked_count = 0;
+
+new_lock(prof_lock);
+
+static void *backend_malloc(size_t size)
 {
     switch (defalloc)
     {
@@ -25,7 +55,27 @@ void *malloc(size_t size)
     return nullptr;
 }
 
-void *calloc(size_t num, size_t size)
+// Only the slab allocator honours the alignment, the others just round the size up.
+// Anything that must be page aligned, like page tables, comes straight from the PMM
+static void *backend_aligned_alloc(size_t alignment, size_t size)
+{
+    switch (defalloc)
+    {
+        case LIBALLOC:
+            return liballoc_malloc(ALIGN_UP(size, alignment));
+            break;
+        case BUDDY:
+            return buddyheap.malloc(ALIGN_UP(size, alignment));
+            break;
+        case SLAB:
+            return slabheap.aligned_alloc(alignment, size);
+            break;
+    }
+    panic("No default allocator!");
+    return nullptr;
+}
+
+static void *backend_calloc(size_t num, size_t size)
 {
     switch (defalloc)
     {
@@ -43,7 +93,7 @@ void *calloc(size_t num, size_t size)
     return nullptr;
 }
 
-void *realloc(void *ptr, size_t size)
+static void *backend_realloc(void *ptr, size_t size)
 {
     switch (defalloc)
     {
@@ -61,7 +111,7 @@ void *realloc(void *ptr, size_t size)
     return nullptr;
 }
 
-void free(void *ptr)
+static void backend_free(void *ptr)
 {
     switch (defalloc)
     {
@@ -78,6 +128,7 @@ void free(void *ptr)
     panic("No default allocator!");
     return;
 }
+
 size_t allocsize(void *ptr)
 {
     switch (defalloc)
@@ -97,6 +148,213 @@ size_t allocsize(void *ptr)
 }
 
 
+void alloc_init()
+{
+    const char *arg = strstr(cmdline, "alloc=");
+    if (arg == nullptr) return;
+    arg += strlen("alloc=");
+
+    if (!strncmp(arg, "liballoc", 8)) defalloc = LIBALLOC;
+    else if (!strncmp(arg, "buddy", 5)) defalloc = BUDDY;
+    else if (!strncmp(arg, "slab", 4)) defalloc = SLAB;
+    else
+    {
+        warn("Unknown allocator on the command line, using the slab allocator");
+        return;
+    }
+    log("Using %s heap allocator", (defalloc == LIBALLOC) ? "liballoc" : (defalloc == BUDDY) ? "buddy" : "slab");
+}
+
+static size_t sizeclass(void *ptr)
+{
+    if (defalloc == SLAB) return slabheap.sizeclass(ptr);
+    return allocsize(ptr);
+}
+
+static inline size_t prof_hash(uint64_t value, size_t entries)
+{
+    return (value ^ (value >> 17) ^ (value >> 31)) % entries;
+}
+
+// Called with interrupts disabled and prof_lock held
+static allocsite_t *prof_site(uint64_t caller, size_t sizeclass)
+{
+    size_t start = prof_hash(caller + sizeclass, allocprof_max_sites);
+    for (size_t i = 0; i < allocprof_max_sites; i++)
+    {
+        allocsite_t *site = &prof_sites[(start + i) % allocprof_max_sites];
+        if (site->caller == caller && site->sizeclass == sizeclass) return site;
+        if (site->caller == 0)
+        {
+            site->caller = caller;
+            site->sizeclass = sizeclass;
+            return site;
+        }
+    }
+    return nullptr;
+}
+
+static void prof_record(void *ptr, uint64_t caller, uint64_t wait)
+{
+    size_t cls = sizeclass(ptr);
+
+    lockit(prof_lock);
+    allocsite_t *site = prof_site(caller, cls);
+    if (site == nullptr)
+    {
+        prof_dropped++;
+        return;
+    }
+    site->allocs++;
+    site->wait += wait;
+
+    // Remember the pointer so its bytes can be taken off the site once it is freed
+    uint64_t addr = reinterpret_cast<uint64_t>(ptr);
+    size_t start = prof_hash(addr, allocprof_max_tracked);
+    for (size_t i = 0; i < allocprof_probes; i++)
+    {
+        tracked_t &entry = prof_tracked[(start + i) % allocprof_max_tracked];
+        if (entry.ptr != 0) continue;
+
+        entry = { addr, static_cast<size_t>(site - prof_sites), cls };
+        site->inuse += cls;
+        __atomic_add_fetch(&prof_tracked_count, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    prof_dropped++;
+}
+
+static void prof_forget(void *ptr)
+{
+    if (ptr == nullptr || __atomic_load_n(&prof_tracked_count, __ATOMIC_RELAXED) == 0) return;
+
+    bool ints = interrupts_enabled();
+    asm volatile ("cli");
+    prof_lock.lock();
+
+    uint64_t addr = reinterpret_cast<uint64_t>(ptr);
+    size_t start = prof_hash(addr, allocprof_max_tracked);
+    for (size_t i = 0; i < allocprof_probes; i++)
+    {
+        tracked_t &entry = prof_tracked[(start + i) % allocprof_max_tracked];
+        if (entry.ptr != addr) continue;
+
+        prof_sites[entry.site].frees++;
+        prof_sites[entry.site].inuse -= entry.sizeclass;
+        entry.ptr = 0;
+        __atomic_sub_fetch(&prof_tracked_count, 1, __ATOMIC_RELAXED);
+        break;
+    }
+
+    prof_lock.unlock();
+    if (ints) asm volatile ("sti");
+}
+
+// Runs func and, for one in prof_rate calls, attributes the result to caller
+template<typename func_t>
+static inline void *profiled(uint64_t caller, func_t func)
+{
+    size_t rate = __atomic_load_n(&prof_rate, __ATOMIC_RELAXED);
+    if (rate == 0 || __atomic_add_fetch(&prof_counter, 1, __ATOMIC_RELAXED) % rate != 0) return func();
+
+    // Interrupts stay off so the wait is read from the CPU that did the allocation
+    bool ints = interrupts_enabled();
+    asm volatile ("cli");
+
+    uint64_t wait = smp::initialised ? this_cpu->slab_wait : 0;
+    void *ret = func();
+    if (smp::initialised) wait = this_cpu->slab_wait - wait;
+
+    if (ret != nullptr) prof_record(ret, caller, wait);
+
+    if (ints) asm volatile ("sti");
+    return ret;
+}
+
+#define CALLER reinterpret_cast<uint64_t>(__builtin_return_address(0))
+
+void *malloc(size_t size)
+{
+    return profiled(CALLER, [&] { return backend_malloc(size); });
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return profiled(CALLER, [&] { return backend_aligned_alloc(alignment, size); });
+}
+
+void *calloc(size_t num, size_t size)
+{
+    return profiled(CALLER, [&] { return backend_calloc(num, size); });
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    prof_forget(ptr);
+    return profiled(CALLER, [&] { return backend_realloc(ptr, size); });
+}
+
+void free(void *ptr)
+{
+    prof_forget(ptr);
+    backend_free(ptr);
+}
+
+void allocprof_enable(size_t rate)
+{
+    __atomic_store_n(&prof_rate, rate, __ATOMIC_RELAXED);
+}
+
+size_t allocprof_rate()
+{
+    return __atomic_load_n(&prof_rate, __ATOMIC_RELAXED);
+}
+
+size_t allocprof_report(char *buffer, size_t size)
+{
+    allocsite_t *sites = static_cast<allocsite_t*>(backend_malloc(sizeof(prof_sites)));
+    if (sites == nullptr) return 0;
+
+    size_t dropped = 0;
+    {
+        bool ints = interrupts_enabled();
+        asm volatile ("cli");
+        prof_lock.lock();
+
+        memcpy(sites, prof_sites, sizeof(prof_sites));
+        dropped = prof_dropped;
+
+        prof_lock.unlock();
+        if (ints) asm volatile ("sti");
+    }
+
+    // Biggest holders of memory first
+    for (size_t i = 1; i < allocprof_max_sites; i++)
+    {
+        allocsite_t site = sites[i];
+        size_t j = i;
+        for (; j > 0 && (sites[j - 1].inuse < site.inuse || (sites[j - 1].inuse == site.inuse && sites[j - 1].allocs < site.allocs)); j--) sites[j] = sites[j - 1];
+        sites[j] = site;
+    }
+
+    size_t len = 0;
+    auto print = [&](const char *fmt, auto ...args)
+    {
+        len += snprintf((len < size) ? buffer + len : nullptr, (len < size) ? size - len : 0, fmt, args...);
+    };
+
+    print("Sampling 1 in %zu allocations, %zu samples dropped\n", allocprof_rate(), dropped);
+    print("%10s %10s %12s %14s %8s  %s\n", "Allocs", "Frees", "In use", "Lock wait", "Class", "Call site");
+    for (size_t i = 0; i < allocprof_max_sites && sites[i].caller != 0; i++)
+    {
+        trace::symtable_t sym = trace::lookup(sites[i].caller);
+        print("%10zu %10zu %12zu %14lu %8zu  %s+0x%lX\n", sites[i].allocs, sites[i].frees, sites[i].inuse, sites[i].wait, sites[i].sizeclass, sym.name.c_str(), sites[i].caller - sym.addr);
+    }
+
+    backend_free(sites);
+    return len;
+}
+
 namespace std
 {
     enum class align_val_t: size_t {};
@@ -104,22 +362,22 @@ namespace std
 
 void *operator new(size_t size)
 {
-    return malloc(size);
+    return profiled(CALLER, [&] { return backend_malloc(size); });
 }
 
 void *operator new(size_t size, std::align_val_t alignment)
 {
-    return malloc(ALIGN_UP(size, static_cast<size_t>(alignment)));
+    return profiled(CALLER, [&] { return backend_aligned_alloc(static_cast<size_t>(alignment), size); });
 }
 
 void *operator new[](size_t size)
 {
-    return malloc(size);
+    return profiled(CALLER, [&] { return backend_malloc(size); });
 }
 
 void *operator new[](size_t size, std::align_val_t alignment)
 {
-    return malloc(ALIGN_UP(size, static_cast<size_t>(alignment)));
+    return profiled(CALLER, [&] { return backend_aligned_alloc(static_cast<size_t>(alignment), size); });
 }
 
 void operator delete(void *ptr)
@@ -6,6 +6,7 @@
 #include <lib/buddy.hpp>
 #include <lib/panic.hpp>
 #include <lib/slab.hpp>
+#include <cstdint>
 #include <cstddef>
 
 enum allocs
@@ -15,23 +16,55 @@ enum allocs
     SLAB
 };
 
-static allocs defalloc = SLAB;
+extern allocs defalloc;
+
+static constexpr size_t allocprof_max_sites = 256;
+static constexpr size_t allocprof_max_tracked = 4096;
+static constexpr size_t allocprof_probes = 8;
+
+struct allocsite_t
+{
+    uint64_t caller;
+    size_t sizeclass;
+
+    size_t allocs;
+    size_t frees;
+    size_t inuse;
+    uint64_t wait;
+};
 
 extern BuddyAlloc buddyheap;
 extern SlabAlloc slabheap;
 
 extern "C" void *malloc(size_t size);
+extern "C" void *aligned_alloc(size_t alignment, size_t size);
 extern "C" void *calloc(size_t num, size_t size);
 extern "C" void *realloc(void *ptr, size_t size);
 extern "C" void free(void *ptr);
 size_t allocsize(void *ptr);
 
+// Picks the backend from alloc=liballoc|buddy|slab on the command line,
+// must run before the first allocation
+void alloc_init();
+
+// Samples one in rate allocations by call site and size class, 0 stops sampling
+void allocprof_enable(size_t rate);
+size_t allocprof_rate();
+// Formats the profile into buffer, returns the full length of the report
+size_t allocprof_report(char *buffer, size_t size);
+
 template<typename type = void*>
 static inline type malloc(size_t size)
 {
     return reinterpret_cast<type>(malloc(size));
 }
 
+template<typename type = void*>
+static inline type aligned_alloc(size_t alignment, size_t size)
+{
+    return reinterpret_cast<type>(aligned_alloc(alignment, size));
+}
+
 template<typename type = void*>
 static inline type calloc(size_t num, size_t size)
 {
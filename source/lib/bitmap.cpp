@@ -9,19 +9,145 @@ bool Bitmap::operator[](uint64_t index)
 
 bool Bitmap::Get(uint64_t index)
 {
-    uint64_t bytei = index / 8;
-    uint8_t biti = index % 8;
-    uint8_t bitindexer = 0b10000000 >> biti;
-    if ((buffer[bytei] & bitindexer) > 0) return true;
-    return false;
+    return buffer[index / 64] & (1UL << (index % 64));
 }
 
 bool Bitmap::Set(uint64_t index, bool value)
 {
-    uint64_t bytei = index / 8;
-    uint8_t biti = index % 8;
-    uint8_t bitindexer = 0b10000000 >> biti;
-    buffer[bytei] &= ~bitindexer;
-    if (value) buffer[bytei] |= bitindexer;
+    if (value) buffer[index / 64] |= (1UL << (index % 64));
+    else buffer[index / 64] &= ~(1UL << (index % 64));
+    UpdateSummary(index / 64);
     return true;
+}
+
+void Bitmap::UpdateSummary(uint64_t word)
+{
+    if (summary == nullptr) return;
+
+    if (buffer[word] == ~0UL) summary[word / 64] |= (1UL << (word % 64));
+    else summary[word / 64] &= ~(1UL << (word % 64));
+}
+
+void Bitmap::BuildSummary()
+{
+    if (summary == nullptr) return;
+
+    for (uint64_t i = 0; i < words(words(size)); i++) summary[i] = 0;
+    for (uint64_t i = 0; i < words(size); i++) UpdateSummary(i);
+}
+
+uint64_t Bitmap::NextNonFull(uint64_t word)
+{
+    uint64_t total = words(size);
+    if (summary == nullptr || word >= total) return word;
+
+    uint64_t i = word / 64;
+    uint64_t bits = ~summary[i] & (~0UL << (word % 64));
+    while (bits == 0)
+    {
+        if (++i >= words(total)) return total;
+        bits = ~summary[i];
+    }
+    return i * 64 + __builtin_ctzll(bits);
+}
+
+void Bitmap::SetRange(uint64_t start, uint64_t count, bool value)
+{
+    if (count == 0) return;
+    uint64_t end = start + count;
+
+    while (start < end)
+    {
+        uint64_t word = start / 64;
+        uint64_t bit = start % 64;
+        uint64_t len = (64 - bit < end - start) ? 64 - bit : end - start;
+        uint64_t mask = (len == 64) ? ~0UL : ((1UL << len) - 1) << bit;
+
+        if (value) buffer[word] |= mask;
+        else buffer[word] &= ~mask;
+        UpdateSummary(word);
+
+        start += len;
+    }
+}
+
+int64_t Bitmap::FindFirstClear(uint64_t start)
+{
+    if (start >= size) return -1;
+
+    uint64_t total = words(size);
+    uint64_t word = start / 64;
+    uint64_t bits = buffer[word] | ((1UL << (start % 64)) - 1);
+
+    while (~bits == 0)
+    {
+        word = NextNonFull(word + 1);
+        if (word >= total) return -1;
+        bits = buffer[word];
+    }
+
+    uint64_t index = word * 64 + __builtin_ctzll(~bits);
+    return (index < size) ? index : -1;
+}
+
+int64_t Bitmap::FindClearRun(uint64_t count, uint64_t start)
+{
+    if (count == 0 || start >= size) return -1;
+    if (count == 1) return FindFirstClear(start);
+
+    uint64_t run = 0;
+    uint64_t runstart = start;
+    uint64_t i = start;
+
+    while (i < size)
+    {
+        if (i % 64 != 0 || i + 64 > size)
+        {
+            if (Get(i))
+            {
+                run = 0;
+                runstart = i + 1;
+            }
+            else if (++run >= count) return runstart;
+            i++;
+            continue;
+        }
+
+        uint64_t bits = buffer[i / 64];
+        if (bits == 0)
+        {
+            run += 64;
+            if (run >= count) return runstart;
+            i += 64;
+        }
+        else if (bits == ~0UL)
+        {
+            i = NextNonFull(i / 64 + 1) * 64;
+            run = 0;
+            runstart = i;
+        }
+        else if (count < 64 && run + __builtin_ctzll(bits) < count)
+        {
+            // A short run may fit inside this word, check it bit by bit
+            uint64_t end = i + 64;
+            for (; i < end; i++)
+            {
+                if (Get(i))
+                {
+                    run = 0;
+                    runstart = i + 1;
+                }
+                else if (++run >= count) return runstart;
+            }
+        }
+        else
+        {
+            if (run + __builtin_ctzll(bits) >= count) return runstart;
+
+            run = __builtin_clzll(bits);
+            i += 64;
+            runstart = i - run;
+        }
+    }
+    return -1;
 }
\ No newline at end of file
@@ -7,8 +7,28 @@
 
 struct Bitmap
 {
-    uint8_t *buffer = nullptr;
+    uint64_t *buffer = nullptr;
+    uint64_t size = 0;
+
+    // Optional, one bit per buffer word, set when that word is full
+    uint64_t *summary = nullptr;
+
+    static constexpr uint64_t words(uint64_t bits)
+    {
+        return (bits + 63) / 64;
+    }
+
     bool operator[](uint64_t index);
     bool Set(uint64_t index, bool value);
     bool Get(uint64_t index);
+
+    void SetRange(uint64_t start, uint64_t count, bool value);
+    void BuildSummary();
+
+    int64_t FindFirstClear(uint64_t start = 0);
+    int64_t FindClearRun(uint64_t count, uint64_t start = 0);
+
+    private:
+    void UpdateSummary(uint64_t word);
+    uint64_t NextNonFull(uint64_t word);
 };
\ No newline at end of file
@@ -9,162 +9,114 @@
 
 using namespace kernel::system::mm;
 
-BuddyBlock *BuddyAlloc::next(BuddyBlock *block)
-{
-    return reinterpret_cast<BuddyBlock*>(reinterpret_cast<uint8_t*>(block) + block->size);
-}
+static constexpr size_t ARENA_SIZE = ARENA_PAGES * 0x1000;
 
-BuddyBlock *BuddyAlloc::split(BuddyBlock *block, size_t size)
+void BuddyAlloc::list_add(BuddyBlock *block, size_t order)
 {
-    if (block != nullptr && size != 0)
-    {
-        while (size < block->size)
-        {
-            size_t sz = block->size >> 1;
-            block->size = sz;
-            block = this->next(block);
-            block->size = sz;
-            block->free = true;
-        }
-        if (size <= block->size) return block;
-    }
-    return nullptr;
+    BuddyBlock *&head = this->freelists[order - BUDDY_MIN_ORDER];
+
+    block->prev = nullptr;
+    block->next = head;
+    if (head != nullptr) head->prev = block;
+    head = block;
 }
 
-BuddyBlock *BuddyAlloc::find_best(size_t size)
+void BuddyAlloc::list_remove(BuddyBlock *block, size_t order)
 {
-    if (size == 0) return nullptr;
-
-    BuddyBlock *best_block = nullptr;
-    BuddyBlock *block = this->head;
-    BuddyBlock *buddy = this->next(block);
-
-    if (buddy == this->tail && block->free) return this->split(block, size);
-
-    while (block < this->tail && buddy < this->tail)
-    {
-        if (block->free && buddy->free && block->size == buddy->size)
-        {
-            block->size <<= 1;
-            if (size <= block->size && (best_block == nullptr || block->size <= best_block->size)) best_block = block;
-
-            block = this->next(buddy);
-            if (block < this->tail) buddy = this->next(block);
-            continue;
-        }
-
-        if (block->free && size <= block->size && (best_block == nullptr || block->size <= best_block->size)) best_block = block;
-        if (buddy->free && size <= buddy->size && (best_block == nullptr || buddy->size < best_block->size)) best_block = buddy;
+    BuddyBlock *&head = this->freelists[order - BUDDY_MIN_ORDER];
 
-        if (block->size <= buddy->size)
-        {
-            block = this->next(buddy);
-            if (block < this->tail) buddy = this->next(block);
-        }
-        else
-        {
-            block = buddy;
-            buddy = this->next(buddy);
-        }
-    }
-
-    if (best_block != nullptr) return this->split(best_block, size);
-
-    return nullptr;
+    if (block->prev != nullptr) block->prev->next = block->next;
+    else head = block->next;
+    if (block->next != nullptr) block->next->prev = block->prev;
 }
 
-size_t BuddyAlloc::required_size(size_t size)
+// Arenas are naturally aligned, so a block's buddy is found by flipping its size bit
+static inline BuddyBlock *buddy_of(BuddyBlock *block, size_t size)
 {
-    size_t actual_size = sizeof(BuddyBlock);
+    uint64_t addr = reinterpret_cast<uint64_t>(block);
+    uint64_t base = addr & ~(ARENA_SIZE - 1);
+    return reinterpret_cast<BuddyBlock*>(base + ((addr - base) ^ size));
+}
 
-    size += sizeof(BuddyBlock);
-    size = ALIGN_UP(size, sizeof(BuddyBlock));
+bool BuddyAlloc::add_arena()
+{
+    BuddyBlock *block = pmm::alloc_constrained<BuddyBlock*>(ARENA_PAGES, UINT64_MAX, ARENA_SIZE, 0, pmm::AllocNoZero);
+    if (block == nullptr) return false;
 
-    while (size > actual_size) actual_size <<= 1;
+    block->size = ARENA_SIZE;
+    block->free = true;
+    this->list_add(block, BUDDY_MAX_ORDER);
+    this->arenas++;
 
-    return actual_size;
+    if (this->debug) log("Buddy: Added arena %zu at 0x%lX", this->arenas, reinterpret_cast<uint64_t>(block));
+    return true;
 }
 
-void BuddyAlloc::coalescence()
+size_t BuddyAlloc::required_order(size_t size)
 {
-    while (true)
-    {
-        BuddyBlock *block = this->head;
-        BuddyBlock *buddy = this->next(block);
-
-        bool no_coalescence = true;
-        while (block < this->tail && buddy < this->tail)
-        {
-            if (block->free && buddy->free && block->size == buddy->size)
-            {
-                block->size <<= 1;
-                block = this->next(block);
-                if (block < this->tail)
-                {
-                    buddy = this->next(block);
-                    no_coalescence = false;
-                }
-            }
-            else if (block->size < buddy->size)
-            {
-                block = buddy;
-                buddy = this->next(buddy);
-            }
-            else
-            {
-                block = this->next(buddy);
-                if (block < this->tail) buddy = this->next(block);
-            }
-        }
-
-        if (no_coalescence) return;
-    }
+    size_t order = BUDDY_MIN_ORDER;
+    while ((1UL << order) < size + BUDDY_HEADER) order++;
+    return order;
 }
 
 void BuddyAlloc::init()
 {
     lockit(this->lock);
+    if (this->arenas > 0) return;
 
-    size_t size = ALIGN_UP_2(0x1000, INIT_PAGES * 0x1000);
-    assert(POWER_OF_2(size), "Buddy: Size is not power of two!");
-
-    this->data = pmm::alloc(size / 0x1000);
-    assert(this->data != nullptr, "Buddy: Could not allocate memory!");
-
-    this->head = static_cast<BuddyBlock*>(this->data);
-    this->head->size = size;
-    this->head->free = true;
-
-    this->tail = this->next(this->head);
-
-    if (this->debug) log("Buddy: Initialised the heap. Current size: %zu bytes, %zu pages", size, size / 0x1000);
+    assert(this->add_arena(), "Buddy: Could not allocate memory!");
+    if (this->debug) log("Buddy: Initialised the heap. Arena size: %zu bytes, %zu pages", ARENA_SIZE, ARENA_PAGES);
 }
 
 void *BuddyAlloc::malloc(size_t size)
 {
     if (size == 0) return nullptr;
-    if (this->data == nullptr) this->init();
+    if (this->arenas == 0) this->init();
 
-    lockit(this->lock);
+    size_t order = this->required_order(size);
 
-    size_t actual_size = this->required_size(size);
+    // Anything bigger than an arena gets its own frames
+    if (order > BUDDY_MAX_ORDER)
+    {
+        BuddyBlock *block = pmm::alloc<BuddyBlock*>(DIV_ROUNDUP(size + BUDDY_HEADER, 0x1000), pmm::AllocNoZero);
+        if (block == nullptr) return nullptr;
 
-    BuddyBlock *found = this->find_best(actual_size);
-    if (found == nullptr)
+        block->size = size + BUDDY_HEADER;
+        block->free = false;
+        return reinterpret_cast<void*>(reinterpret_cast<uint8_t*>(block) + BUDDY_HEADER);
+    }
+
+    lockit(this->lock);
+
+    size_t curr = order;
+    while (curr <= BUDDY_MAX_ORDER && this->freelists[curr - BUDDY_MIN_ORDER] == nullptr) curr++;
+    if (curr > BUDDY_MAX_ORDER)
     {
-        this->coalescence();
-        found = this->find_best(actual_size);
+        if (!this->add_arena())
+        {
+            error("Buddy: Could not allocate memory!");
+            return nullptr;
+        }
+        curr = BUDDY_MAX_ORDER;
     }
 
-    if (found != nullptr)
+    BuddyBlock *block = this->freelists[curr - BUDDY_MIN_ORDER];
+    this->list_remove(block, curr);
+
+    while (curr > order)
     {
-        if (this->debug) log("Buddy: Allocated %zu bytes", size);
-        found->free = false;
-        return reinterpret_cast<void*>(reinterpret_cast<uint8_t*>(found) + sizeof(BuddyBlock));
+        curr--;
+        BuddyBlock *buddy = reinterpret_cast<BuddyBlock*>(reinterpret_cast<uint8_t*>(block) + (1UL << curr));
+        buddy->size = 1UL << curr;
+        buddy->free = true;
+        this->list_add(buddy, curr);
     }
 
-    error("Buddy: Could not allocate memory!");
-    return nullptr;
+    block->size = 1UL << order;
+    block->free = false;
+
+    if (this->debug) log("Buddy: Allocated %zu bytes", size);
+    return reinterpret_cast<void*>(reinterpret_cast<uint8_t*>(block) + BUDDY_HEADER);
 }
 
 void *BuddyAlloc::calloc(size_t num, size_t size)
@@ -180,14 +132,17 @@ void *BuddyAlloc::realloc(void *ptr, size_t size)
 {
     if (!ptr) return this->malloc(size);
 
-    BuddyBlock *block = reinterpret_cast<BuddyBlock*>(reinterpret_cast<uint8_t*>(ptr) - sizeof(BuddyBlock));
-    size_t oldsize = block->size;
+    BuddyBlock *block = reinterpret_cast<BuddyBlock*>(reinterpret_cast<uint8_t*>(ptr) - BUDDY_HEADER);
+    size_t oldsize = block->size - BUDDY_HEADER;
 
     if (size == 0)
     {
         this->free(ptr);
         return nullptr;
     }
+
+    // Still the right block size
+    if (block->size <= ARENA_SIZE && (1UL << this->required_order(size)) == block->size) return ptr;
     if (size < oldsize) oldsize = size;
 
     void *newptr = this->malloc(size);
@@ -200,25 +155,57 @@ void *BuddyAlloc::realloc(void *ptr, size_t size)
 
 void BuddyAlloc::free(void *ptr)
 {
-    if (this->data == nullptr) return;
+    if (this->arenas == 0) return;
     if (ptr == nullptr) return;
 
-    assert(this->head <= ptr, "Buddy: Head is not smaller than pointer!");
-    assert(ptr < this->tail, "Buddy: Pointer is not smaller than tail!");
+    BuddyBlock *block = reinterpret_cast<BuddyBlock*>(reinterpret_cast<uint8_t*>(ptr) - BUDDY_HEADER);
+    assert(!block->free, "Buddy: Double free!");
+
+    if (block->size > ARENA_SIZE)
+    {
+        pmm::free(block, DIV_ROUNDUP(block->size, 0x1000));
+        return;
+    }
 
     lockit(this->lock);
 
-    BuddyBlock *block = reinterpret_cast<BuddyBlock*>(reinterpret_cast<uint8_t*>(ptr) - sizeof(BuddyBlock));
-    block->free = true;
+    if (this->debug) log("Buddy: Freed %zu bytes", block->size - BUDDY_HEADER);
+
+    size_t size = block->size;
+    size_t order = __builtin_ctzl(size);
+    while (order < BUDDY_MAX_ORDER)
+    {
+        BuddyBlock *buddy = buddy_of(block, size);
+        if (!buddy->free || buddy->size != size) break;
 
-    if (this->debug) log("Buddy: Freed %zu bytes", block->size - sizeof(BuddyBlock));
+        this->list_remove(buddy, order);
+        if (buddy < block) block = buddy;
+        size <<= 1;
+        order++;
+    }
 
-    this->coalescence();
+    // Keep one arena around, give the rest back once they are empty
+    if (order == BUDDY_MAX_ORDER && this->arenas > 1)
+    {
+        pmm::free(block, ARENA_PAGES);
+        this->arenas--;
+        if (this->debug) log("Buddy: Released an arena, %zu left", this->arenas);
+        return;
+    }
+
+    block->size = size;
+    block->free = true;
+    this->list_add(block, order);
 }
 
 size_t BuddyAlloc::allocsize(void *ptr)
 {
-    if (this->data == nullptr) return 0;
+    if (this->arenas == 0) return 0;
     if (!ptr) return 0;
-    return (reinterpret_cast<BuddyBlock*>(reinterpret_cast<uint8_t*>(ptr) - sizeof(BuddyBlock)))->size - sizeof(BuddyBlock);
+    return (reinterpret_cast<BuddyBlock*>(reinterpret_cast<uint8_t*>(ptr) - BUDDY_HEADER))->size - BUDDY_HEADER;
+}
+
+size_t BuddyAlloc::arenacount()
+{
+    return this->arenas;
 }
\ No newline at end of file
@@ -6,28 +6,36 @@
 #include <cstdint>
 #include <cstddef>
 
-static constexpr uint64_t INIT_PAGES = 1024;
+static constexpr uint64_t ARENA_PAGES = 1024;
+
+static constexpr size_t BUDDY_MIN_ORDER = 5;
+static constexpr size_t BUDDY_MAX_ORDER = 22;
+static constexpr size_t BUDDY_HEADER = 16;
+static_assert((1UL << BUDDY_MAX_ORDER) == ARENA_PAGES * 0x1000);
 
 struct BuddyBlock
 {
     size_t size;
     bool free;
+
+    // Only valid while the block is on a free list
+    BuddyBlock *next;
+    BuddyBlock *prev;
 };
+static_assert(sizeof(BuddyBlock) <= (1UL << BUDDY_MIN_ORDER));
 
 class BuddyAlloc
 {
     private:
-    BuddyBlock *head = nullptr;
-    BuddyBlock *tail = nullptr;
-    void *data = nullptr;
+    BuddyBlock *freelists[BUDDY_MAX_ORDER - BUDDY_MIN_ORDER + 1] = { };
+    size_t arenas = 0;
     lock_t lock;
 
-    BuddyBlock *next(BuddyBlock *block);
-    BuddyBlock *split(BuddyBlock *block, size_t size);
+    void list_add(BuddyBlock *block, size_t order);
+    void list_remove(BuddyBlock *block, size_t order);
 
-    BuddyBlock *find_best(size_t size);
-    size_t required_size(size_t size);
-    void coalescence();
+    bool add_arena();
+    size_t required_order(size_t size);
 
     public:
     bool debug = false;
@@ -40,4 +48,5 @@ class BuddyAlloc
     void free(void *ptr);
 
     size_t allocsize(void *ptr);
+    size_t arenacount();
 };
\ No newline at end of file
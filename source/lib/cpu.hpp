@@ -54,6 +54,20 @@ void fxrstor(uint8_t *region);
 
 void invlpg(uint64_t addr);
 
+static inline bool interrupts_enabled()
+{
+    uint64_t rflags;
+    asm volatile ("pushfq; pop %0" : "=r"(rflags) : : "memory");
+    return rflags & (1 << 9);
+}
+
+static inline uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return (static_cast<uint64_t>(hi) << 32) | lo;
+}
+
 void enableSSE();
 void enableSMEP();
 void enableSMAP();
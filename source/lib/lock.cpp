@@ -13,6 +13,11 @@ void lock_t::unlock()
     __atomic_clear(&this->locked, __ATOMIC_RELEASE);
 }
 
+bool lock_t::trylock()
+{
+    return !__atomic_test_and_set(&this->locked, __ATOMIC_ACQUIRE);
+}
+
 bool lock_t::test()
 {
     return this->locked;
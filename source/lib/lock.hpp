@@ -12,6 +12,7 @@ class lock_t
     public:
     void lock();
     void unlock();
+    bool trylock();
     bool test();
 };
 
@@ -0,0 +1,296 @@
+// Copyright (C) 2021-2022  ilobilo
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+struct rbnode
+{
+    rbnode *parent = nullptr;
+    rbnode *left = nullptr;
+    rbnode *right = nullptr;
+    bool red = false;
+};
+
+// Intrusive red-black tree of items ordered by a unique integer key.
+// Items embed an rbnode, nothing is allocated by the tree itself
+template<typename type, rbnode type::*link, uint64_t type::*key>
+class rbtree
+{
+    private:
+    rbnode *root = nullptr;
+    size_t count = 0;
+
+    static type *entry(rbnode *node)
+    {
+        if (node == nullptr) return nullptr;
+        size_t offset = reinterpret_cast<size_t>(&(reinterpret_cast<type*>(0)->*link));
+        return reinterpret_cast<type*>(reinterpret_cast<uint8_t*>(node) - offset);
+    }
+
+    static bool is_red(rbnode *node)
+    {
+        return node != nullptr && node->red;
+    }
+
+    void rotate_left(rbnode *node)
+    {
+        rbnode *right = node->right;
+        node->right = right->left;
+        if (right->left != nullptr) right->left->parent = node;
+        this->transplant(node, right);
+        right->left = node;
+        node->parent = right;
+    }
+
+    void rotate_right(rbnode *node)
+    {
+        rbnode *left = node->left;
+        node->left = left->right;
+        if (left->right != nullptr) left->right->parent = node;
+        this->transplant(node, left);
+        left->right = node;
+        node->parent = left;
+    }
+
+    // Puts replacement where node was in node's parent
+    void transplant(rbnode *node, rbnode *replacement)
+    {
+        if (node->parent == nullptr) this->root = replacement;
+        else if (node == node->parent->left) node->parent->left = replacement;
+        else node->parent->right = replacement;
+        if (replacement != nullptr) replacement->parent = node->parent;
+    }
+
+    void insert_fixup(rbnode *node)
+    {
+        while (node != this->root && is_red(node->parent))
+        {
+            rbnode *parent = node->parent;
+            rbnode *grandparent = parent->parent;
+
+            if (parent == grandparent->left)
+            {
+                rbnode *uncle = grandparent->right;
+                if (is_red(uncle))
+                {
+                    parent->red = false;
+                    uncle->red = false;
+                    grandparent->red = true;
+                    node = grandparent;
+                    continue;
+                }
+                if (node == parent->right)
+                {
+                    this->rotate_left(parent);
+                    node = parent;
+                    parent = node->parent;
+                }
+                parent->red = false;
+                grandparent->red = true;
+                this->rotate_right(grandparent);
+            }
+            else
+            {
+                rbnode *uncle = grandparent->left;
+                if (is_red(uncle))
+                {
+                    parent->red = false;
+                    uncle->red = false;
+                    grandparent->red = true;
+                    node = grandparent;
+                    continue;
+                }
+                if (node == parent->left)
+                {
+                    this->rotate_right(parent);
+                    node = parent;
+                    parent = node->parent;
+                }
+                parent->red = false;
+                grandparent->red = true;
+                this->rotate_left(grandparent);
+            }
+        }
+        this->root->red = false;
+    }
+
+    // node may be null, so its parent is passed separately
+    void remove_fixup(rbnode *node, rbnode *parent)
+    {
+        while (node != this->root && !is_red(node))
+        {
+            if (node == parent->left)
+            {
+                rbnode *sibling = parent->right;
+                if (is_red(sibling))
+                {
+                    sibling->red = false;
+                    parent->red = true;
+                    this->rotate_left(parent);
+                    sibling = parent->right;
+                }
+                if (!is_red(sibling->left) && !is_red(sibling->right))
+                {
+                    sibling->red = true;
+                    node = parent;
+                    parent = node->parent;
+                    continue;
+                }
+                if (!is_red(sibling->right))
+                {
+                    sibling->left->red = false;
+                    sibling->red = true;
+                    this->rotate_right(sibling);
+                    sibling = parent->right;
+                }
+                sibling->red = parent->red;
+                parent->red = false;
+                sibling->right->red = false;
+                this->rotate_left(parent);
+            }
+            else
+            {
+                rbnode *sibling = parent->left;
+                if (is_red(sibling))
+                {
+                    sibling->red = false;
+                    parent->red = true;
+                    this->rotate_right(parent);
+                    sibling = parent->left;
+                }
+                if (!is_red(sibling->left) && !is_red(sibling->right))
+                {
+                    sibling->red = true;
+                    node = parent;
+                    parent = node->parent;
+                    continue;
+                }
+                if (!is_red(sibling->left))
+                {
+                    sibling->right->red = false;
+                    sibling->red = true;
+                    this->rotate_left(sibling);
+                    sibling = parent->left;
+                }
+                sibling->red = parent->red;
+                parent->red = false;
+                sibling->left->red = false;
+                this->rotate_right(parent);
+            }
+            node = this->root;
+        }
+        if (node != nullptr) node->red = false;
+    }
+
+    public:
+    void insert(type *item)
+    {
+        rbnode *node = &(item->*link);
+        rbnode *parent = nullptr;
+        rbnode **curr = &this->root;
+
+        while (*curr != nullptr)
+        {
+            parent = *curr;
+            curr = (item->*key < entry(parent)->*key) ? &parent->left : &parent->right;
+        }
+
+        node->parent = parent;
+        node->left = nullptr;
+        node->right = nullptr;
+        node->red = true;
+        *curr = node;
+
+        this->insert_fixup(node);
+        this->count++;
+    }
+
+    void remove(type *item)
+    {
+        rbnode *node = &(item->*link);
+        rbnode *child = nullptr;
+        rbnode *parent = nullptr;
+        bool red = node->red;
+
+        if (node->left == nullptr)
+        {
+            child = node->right;
+            parent = node->parent;
+            this->transplant(node, node->right);
+        }
+        else if (node->right == nullptr)
+        {
+            child = node->left;
+            parent = node->parent;
+            this->transplant(node, node->left);
+        }
+        else
+        {
+            rbnode *next = node->right;
+            while (next->left != nullptr) next = next->left;
+
+            red = next->red;
+            child = next->right;
+            if (next->parent == node) parent = next;
+            else
+            {
+                parent = next->parent;
+                this->transplant(next, next->right);
+                next->right = node->right;
+                next->right->parent = next;
+            }
+            this->transplant(node, next);
+            next->left = node->left;
+            next->left->parent = next;
+            next->red = node->red;
+        }
+
+        if (red == false) this->remove_fixup(child, parent);
+        node->parent = node->left = node->right = nullptr;
+        this->count--;
+    }
+
+    // Item with the largest key that is not above k
+    type *floor(uint64_t k)
+    {
+        rbnode *node = this->root;
+        rbnode *ret = nullptr;
+        while (node != nullptr)
+        {
+            if (entry(node)->*key <= k)
+            {
+                ret = node;
+                node = node->right;
+            }
+            else node = node->left;
+        }
+        return entry(ret);
+    }
+
+    type *first()
+    {
+        rbnode *node = this->root;
+        while (node != nullptr && node->left != nullptr) node = node->left;
+        return entry(node);
+    }
+
+    type *next(type *item)
+    {
+        rbnode *node = &(item->*link);
+        if (node->right != nullptr)
+        {
+            node = node->right;
+            while (node->left != nullptr) node = node->left;
+            return entry(node);
+        }
+        while (node->parent != nullptr && node == node->parent->right) node = node->parent;
+        return entry(node->parent);
+    }
+
+    size_t size()
+    {
+        return this->count;
+    }
+};
\ No newline at end of file
@@ -1,53 +1,370 @@
 // Copyright (C) 2021-2022  ilobilo
 
+#include <system/cpu/smp/smp.hpp>
 #include <system/mm/pmm/pmm.hpp>
+#include <kernel/kernel.hpp>
 #include <lib/memory.hpp>
 #include <lib/math.hpp>
+#include <lib/cpu.hpp>
 #include <lib/slab.hpp>
 #include <lib/log.hpp>
 
+using namespace kernel::system::cpu;
 using namespace kernel::system::mm;
 
-void slab_t::init(uint64_t size)
+static slab_t *slab_list = nullptr;
+new_lock(slab_list_lock);
+
+static void list_add(slabHdr **list, slabHdr *hdr)
+{
+    hdr->prev = nullptr;
+    hdr->next = *list;
+    if (hdr->next) hdr->next->prev = hdr;
+    *list = hdr;
+}
+
+static void list_remove(slabHdr **list, slabHdr *hdr)
 {
+    if (hdr->prev) hdr->prev->next = hdr->next;
+    else *list = hdr->next;
+    if (hdr->next) hdr->next->prev = hdr->prev;
+    hdr->next = hdr->prev = nullptr;
+}
+
+void slab_t::init(const char *name, uint64_t size, size_t align, void (*ctor)(void *obj), slab_t *hdrcache)
+{
+    this->name = name;
     this->size = size;
-    this->firstfree = pmm::alloc<uint64_t>();
+    this->align = (align < 8) ? 8 : align;
+    this->ctor = ctor;
+    this->hdrcache = hdrcache;
+
+    // The free list link lives in the object itself unless the object has a
+    // constructed state to preserve, in which case it gets a word of its own
+    uint64_t objsize = (size < 8) ? 8 : size;
+    if (ctor != nullptr)
+    {
+        this->freeoff = ALIGN_UP(size, 8);
+        objsize = this->freeoff + 8;
+    }
+    this->stride = ALIGN_UP(objsize, this->align);
+    this->offset = (hdrcache != nullptr) ? 0 : ALIGN_UP(sizeof(slabHdr), this->align);
+
+    // Smallest slab that wastes at most an eighth of itself
+    for (this->order = 0; this->order < slab_max_order; this->order++)
+    {
+        size_t slabsize = 0x1000UL << this->order;
+        if (slabsize < this->offset + this->stride) continue;
 
-    uint64_t available = 0x1000 - ALIGN_UP(sizeof(slabHdr), this->size);
-    slabHdr *slabptr = reinterpret_cast<slabHdr*>(this->firstfree);
-    slabptr->slab = this;
-    this->firstfree += ALIGN_UP(sizeof(slabHdr), this->size);
+        size_t waste = (slabsize - this->offset) % this->stride;
+        if (waste * 8 <= slabsize) break;
+    }
+    size_t slabsize = 0x1000UL << this->order;
+    assert(slabsize >= this->offset + this->stride, "Slab: Object is too big!");
+    this->total = (slabsize - this->offset) / this->stride;
 
-    uint64_t *array = reinterpret_cast<uint64_t*>(this->firstfree);
-    uint64_t max = available / this->size - 1;
-    uint64_t fact = this->size / 8;
-    for (size_t i = 0; i < max; i++) array[i * fact] = reinterpret_cast<uint64_t>(&array[(i + 1) * fact]);
-    array[max * fact] = 0;
+    // Leftover space shifts the first object of consecutive slabs by a cache line
+    size_t step = ALIGN_UP(slab_colour_size, this->align);
+    this->colours = (slabsize - this->offset - this->total * this->stride) / step + 1;
+
+    lockit(slab_list_lock);
+    this->next = slab_list;
+    slab_list = this;
+}
+
+void slab_t::init(uint64_t size, slab_t *hdrcache)
+{
+    // Lowest set bit, so 24 byte objects are 8 byte aligned and 3072 byte ones 1024
+    this->init(nullptr, size, size & -size, nullptr, hdrcache);
+}
+
+static inline slabHdr *obj2hdr(void *ptr)
+{
+    return reinterpret_cast<slabHdr*>(pmm::phys2page(reinterpret_cast<uint64_t>(ptr))->priv);
+}
+
+static inline uint64_t &obj2link(slab_t *slab, uint64_t obj)
+{
+    return *reinterpret_cast<uint64_t*>(obj + slab->freeoff);
+}
+
+slabHdr *slab_t::grow()
+{
+    size_t count = 1UL << this->order;
+    uint64_t base = pmm::alloc<uint64_t>(count, pmm::AllocNoZero);
+    if (base == 0) return nullptr;
+
+    slabHdr *hdr = reinterpret_cast<slabHdr*>(base);
+    if (this->hdrcache != nullptr)
+    {
+        hdr = static_cast<slabHdr*>(this->hdrcache->alloc());
+        if (hdr == nullptr)
+        {
+            pmm::free(reinterpret_cast<void*>(base), count);
+            return nullptr;
+        }
+    }
+
+    uint64_t start = base + this->offset + this->colour * ALIGN_UP(slab_colour_size, this->align);
+    this->colour = (this->colour + 1) % this->colours;
+
+    hdr->slab = this;
+    hdr->base = base;
+    hdr->inuse = 0;
+    hdr->total = this->total;
+    hdr->firstfree = start;
+
+    for (size_t i = 0; i < hdr->total; i++)
+    {
+        uint64_t obj = start + i * this->stride;
+        if (this->ctor != nullptr) this->ctor(reinterpret_cast<void*>(obj));
+        obj2link(this, obj) = (i == hdr->total - 1) ? 0 : obj + this->stride;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        pmm::page_t *page = pmm::phys2page(base + i * 0x1000);
+        page->flags |= pmm::PageSlab;
+        page->priv = reinterpret_cast<uint64_t>(hdr);
+    }
+
+    this->pages += count;
+    this->emptycount++;
+    list_add(&this->empty, hdr);
+    return hdr;
+}
+
+void slab_t::release(slabHdr *hdr)
+{
+    size_t count = 1UL << this->order;
+    for (size_t i = 0; i < count; i++)
+    {
+        pmm::page_t *page = pmm::phys2page(hdr->base + i * 0x1000);
+        page->flags &= ~pmm::PageSlab;
+        page->priv = 0;
+    }
+    pmm::free(reinterpret_cast<void*>(hdr->base), count);
+    if (this->hdrcache != nullptr) this->hdrcache->free(hdr);
+    this->pages -= count;
+}
+
+void *slab_t::alloc_locked()
+{
+    slabHdr *hdr = this->partial;
+    if (hdr == nullptr)
+    {
+        hdr = this->empty ? this->empty : this->grow();
+        if (hdr == nullptr) return nullptr;
+
+        list_remove(&this->empty, hdr);
+        this->emptycount--;
+        list_add(&this->partial, hdr);
+    }
+
+    uint64_t obj = hdr->firstfree;
+    hdr->firstfree = obj2link(this, obj);
+    if (++hdr->inuse == hdr->total)
+    {
+        list_remove(&this->partial, hdr);
+        list_add(&this->full, hdr);
+    }
+    return reinterpret_cast<void*>(obj);
+}
+
+void slab_t::free_locked(void *ptr)
+{
+    slabHdr *hdr = obj2hdr(ptr);
+
+    obj2link(this, reinterpret_cast<uint64_t>(ptr)) = hdr->firstfree;
+    hdr->firstfree = reinterpret_cast<uint64_t>(ptr);
+
+    if (hdr->inuse-- == hdr->total)
+    {
+        list_remove(&this->full, hdr);
+        list_add(&this->partial, hdr);
+    }
+    if (hdr->inuse == 0)
+    {
+        list_remove(&this->partial, hdr);
+        if (this->emptycount >= slab_empty_reserve) this->release(hdr);
+        else
+        {
+            list_add(&this->empty, hdr);
+            this->emptycount++;
+        }
+    }
+}
+
+// Flushes this CPU's magazines and frees every empty slab
+size_t slab_t::reclaim()
+{
+    bool ints = interrupts_enabled();
+    asm volatile ("cli");
+
+    size_t ret = 0;
+    if (this->lock.trylock())
+    {
+        slab_cpu_t *cpu = smp::initialised ? this->cpus : nullptr;
+        if (cpu != nullptr)
+        {
+            cpu = &cpu[this_cpu->id];
+            while (cpu->loaded->count > 0) this->free_locked(cpu->loaded->objects[--cpu->loaded->count]);
+            while (cpu->previous->count > 0) this->free_locked(cpu->previous->objects[--cpu->previous->count]);
+        }
+
+        while (this->empty != nullptr)
+        {
+            slabHdr *hdr = this->empty;
+            list_remove(&this->empty, hdr);
+            this->release(hdr);
+            ret += 1UL << this->order;
+        }
+        this->emptycount = 0;
+        this->lock.unlock();
+    }
+
+    if (ints) asm volatile ("sti");
+    return ret;
+}
+
+size_t slab_reclaim()
+{
+    size_t ret = 0;
+    lockit(slab_list_lock);
+    for (slab_t *slab = slab_list; slab != nullptr; slab = slab->next) ret += slab->reclaim();
+    return ret;
+}
+
+void slab_foreach(void (*func)(slab_t *slab))
+{
+    lockit(slab_list_lock);
+    for (slab_t *slab = slab_list; slab != nullptr; slab = slab->next) func(slab);
+}
+
+// Must be called with interrupts disabled. Time spent spinning is added to
+// the slab and to this CPU's total in TSC cycles
+void slab_t::acquire()
+{
+    if (this->lock.trylock()) return;
+
+    uint64_t start = rdtsc();
+    this->lock.lock();
+    uint64_t wait = rdtsc() - start;
+
+    __atomic_add_fetch(&this->waited, wait, __ATOMIC_RELAXED);
+    if (smp::initialised) this_cpu->slab_wait += wait;
+}
+
+// Must be called with interrupts disabled
+slab_cpu_t *slab_t::get_cpu()
+{
+    if (!smp::initialised) return nullptr;
+
+    slab_cpu_t *cpus = __atomic_load_n(&this->cpus, __ATOMIC_ACQUIRE);
+    if (cpus == nullptr)
+    {
+        lockit(this->lock);
+        cpus = this->cpus;
+        if (cpus == nullptr)
+        {
+            size_t count = smp_request.response->cpu_count;
+            cpus = pmm::alloc<slab_cpu_t*>(DIV_ROUNDUP(sizeof(slab_cpu_t) * count, 0x1000));
+            for (size_t i = 0; i < count; i++)
+            {
+                cpus[i].loaded = &cpus[i].magazines[0];
+                cpus[i].previous = &cpus[i].magazines[1];
+            }
+            __atomic_store_n(&this->cpus, cpus, __ATOMIC_RELEASE);
+        }
+    }
+    return &cpus[this_cpu->id];
 }
 
 void *slab_t::alloc()
 {
-    lockit(this->lock);
+    bool ints = interrupts_enabled();
+    asm volatile ("cli");
+
+    void *ret = nullptr;
+    slab_cpu_t *cpu = this->get_cpu();
+    if (cpu == nullptr)
+    {
+        this->acquire();
+        ret = this->alloc_locked();
+        this->lock.unlock();
+    }
+    else
+    {
+        if (cpu->loaded->count == 0 && cpu->previous->count > 0)
+        {
+            slab_magazine_t *tmp = cpu->loaded;
+            cpu->loaded = cpu->previous;
+            cpu->previous = tmp;
+        }
+        if (cpu->loaded->count == 0)
+        {
+            this->acquire();
+            while (cpu->loaded->count < slab_magazine_size / 2)
+            {
+                void *obj = this->alloc_locked();
+                if (obj == nullptr) break;
+                cpu->loaded->objects[cpu->loaded->count++] = obj;
+            }
+            this->lock.unlock();
+        }
+        if (cpu->loaded->count > 0) ret = cpu->loaded->objects[--cpu->loaded->count];
+    }
 
-    if (this->firstfree == 0) this->init(this->size);
-    uint64_t *oldfree = reinterpret_cast<uint64_t*>(this->firstfree);
-    this->firstfree = oldfree[0];
-    memset(oldfree, 0, this->size);
-    return oldfree;
+    if (ints) asm volatile ("sti");
+    if (ret == nullptr) return nullptr;
+
+    __atomic_add_fetch(&this->allocs, 1, __ATOMIC_RELAXED);
+    if (this->ctor == nullptr) memset(ret, 0, this->size);
+    return ret;
 }
 
 void slab_t::free(void *ptr)
 {
     if (ptr == nullptr) return;
-    lockit(this->lock);
+    __atomic_add_fetch(&this->frees, 1, __ATOMIC_RELAXED);
+
+    bool ints = interrupts_enabled();
+    asm volatile ("cli");
+
+    slab_cpu_t *cpu = this->get_cpu();
+    if (cpu == nullptr)
+    {
+        this->acquire();
+        this->free_locked(ptr);
+        this->lock.unlock();
+    }
+    else
+    {
+        if (cpu->loaded->count == slab_magazine_size)
+        {
+            if (cpu->previous->count == 0)
+            {
+                slab_magazine_t *tmp = cpu->loaded;
+                cpu->loaded = cpu->previous;
+                cpu->previous = tmp;
+            }
+            else
+            {
+                this->acquire();
+                while (cpu->loaded->count > slab_magazine_size / 2) this->free_locked(cpu->loaded->objects[--cpu->loaded->count]);
+                this->lock.unlock();
+            }
+        }
+        cpu->loaded->objects[cpu->loaded->count++] = ptr;
+    }
 
-    uint64_t *newhead = static_cast<uint64_t*>(ptr);
-    newhead[0] = this->firstfree;
-    this->firstfree = reinterpret_cast<uint64_t>(newhead);
+    if (ints) asm volatile ("sti");
 }
 
 SlabAlloc::SlabAlloc()
 {
+    pmm::add_reclaim_hook(slab_reclaim);
+
     this->slabs[0].init(8);
     this->slabs[1].init(16);
     this->slabs[2].init(24);
@@ -58,38 +375,46 @@ SlabAlloc::SlabAlloc()
     this->slabs[7].init(256);
     this->slabs[8].init(512);
     this->slabs[9].init(1024);
+
+    // Medium classes keep their headers out of line so a whole slab holds objects
+    this->hdrs.init("slabHdr", sizeof(slabHdr), alignof(slabHdr));
+    this->slabs[10].init(2048, &this->hdrs);
+    this->slabs[11].init(3072, &this->hdrs);
 }
 
-slab_t *SlabAlloc::get_slab(size_t size)
+// Objects of every class are aligned to the lowest set bit of its size, so
+// the first class that is both big enough and aligned enough satisfies align
+slab_t *SlabAlloc::get_slab(size_t size, size_t align)
 {
     for (slab_t &slab : this->slabs)
     {
-        if (slab.size >= size) return &slab;
+        if (slab.size >= size && slab.align >= align) return &slab;
     }
     return nullptr;
 }
 
-void *SlabAlloc::big_malloc(size_t size)
+// Page sized and larger allocations take exactly as many frames as they need,
+// their size is kept in the page_t of the first frame
+void *SlabAlloc::big_malloc(size_t size, size_t align)
 {
     size_t pages = DIV_ROUNDUP(size, 0x1000);
-    void *ptr = pmm::alloc(pages + 1);
+    void *ptr = (align > 0x1000) ? pmm::alloc_constrained(pages, UINT64_MAX, align) : pmm::alloc(pages);
     if (ptr == nullptr) return nullptr;
-    bigallocMeta *metadata = reinterpret_cast<bigallocMeta*>(ptr);
-    metadata->pages = pages;
-    metadata->size = size;
-    return reinterpret_cast<void*>(reinterpret_cast<uint64_t>(ptr) + 0x1000);
+
+    pmm::phys2page(reinterpret_cast<uint64_t>(ptr))->priv = size;
+    return ptr;
 }
 
 void *SlabAlloc::big_realloc(void *oldptr, size_t size)
 {
     if (oldptr == nullptr) return this->malloc(size);
 
-    bigallocMeta *metadata = reinterpret_cast<bigallocMeta*>(reinterpret_cast<uint64_t>(oldptr) - 0x1000);
-    size_t oldsize = metadata->size;
+    pmm::page_t *page = pmm::phys2page(reinterpret_cast<uint64_t>(oldptr));
+    size_t oldsize = page->priv;
 
     if (DIV_ROUNDUP(oldsize, 0x1000) == DIV_ROUNDUP(size, 0x1000))
     {
-        metadata->size = size;
+        page->priv = size;
         return oldptr;
     }
 
@@ -110,13 +435,20 @@ void *SlabAlloc::big_realloc(void *oldptr, size_t size)
 
 void SlabAlloc::big_free(void *ptr)
 {
-    bigallocMeta *metadata = reinterpret_cast<bigallocMeta*>(reinterpret_cast<uint64_t>(ptr) - 0x1000);
-    pmm::free(metadata, metadata->pages + 1);
+    pmm::page_t *page = pmm::phys2page(reinterpret_cast<uint64_t>(ptr));
+    size_t pages = DIV_ROUNDUP(page->priv, 0x1000);
+    page->priv = 0;
+    pmm::free(ptr, pages);
 }
 
 size_t SlabAlloc::big_allocsize(void *ptr)
 {
-    return reinterpret_cast<bigallocMeta*>(reinterpret_cast<uint64_t>(ptr) - 0x1000)->size;
+    return pmm::phys2page(reinterpret_cast<uint64_t>(ptr))->priv;
+}
+
+static inline bool is_slab(void *ptr)
+{
+    return pmm::phys2page(reinterpret_cast<uint64_t>(ptr))->flags & pmm::PageSlab;
 }
 
 void *SlabAlloc::malloc(size_t size)
@@ -126,6 +458,15 @@ void *SlabAlloc::malloc(size_t size)
     return slab->alloc();
 }
 
+void *SlabAlloc::aligned_alloc(size_t align, size_t size)
+{
+    assert(align != 0 && (align & (align - 1)) == 0, "Slab: Alignment must be a power of two!");
+
+    slab_t *slab = this->get_slab(size, align);
+    if (slab == nullptr) return this->big_malloc(size, align);
+    return slab->alloc();
+}
+
 void *SlabAlloc::calloc(size_t num, size_t size)
 {
     void *ptr = this->malloc(num * size);
@@ -139,9 +480,9 @@ void *SlabAlloc::realloc(void *oldptr, size_t size)
 {
     if (oldptr == nullptr) return this->malloc(size);
 
-    if ((reinterpret_cast<uint64_t>(oldptr) & 0xFFF) == 0) return this->big_realloc(oldptr, size);
+    if (!is_slab(oldptr)) return this->big_realloc(oldptr, size);
 
-    slab_t *slab = reinterpret_cast<slabHdr*>(reinterpret_cast<uint64_t>(oldptr) & ~0xFFF)->slab;
+    slab_t *slab = obj2hdr(oldptr)->slab;
     size_t oldsize = slab->size;
 
     if (size == 0)
@@ -163,14 +504,22 @@ void SlabAlloc::free(void *ptr)
 {
     if (ptr == nullptr) return;
 
-    if ((reinterpret_cast<uint64_t>(ptr) & 0xFFF) == 0) return this->big_free(ptr);
-    reinterpret_cast<slabHdr*>(reinterpret_cast<uint64_t>(ptr) & ~0xFFF)->slab->free(ptr);
+    if (!is_slab(ptr)) return this->big_free(ptr);
+    obj2hdr(ptr)->slab->free(ptr);
 }
 
 size_t SlabAlloc::allocsize(void *ptr)
 {
     if (ptr == nullptr) return 0;
 
-    if ((reinterpret_cast<uint64_t>(ptr) & 0xFFF) == 0) return this->big_allocsize(ptr);
-    return reinterpret_cast<slabHdr*>(reinterpret_cast<uint64_t>(ptr) & ~0xFFF)->slab->size;
+    if (!is_slab(ptr)) return this->big_allocsize(ptr);
+    return obj2hdr(ptr)->slab->size;
+}
+
+size_t SlabAlloc::sizeclass(void *ptr)
+{
+    if (ptr == nullptr) return 0;
+
+    if (!is_slab(ptr)) return ALIGN_UP(this->big_allocsize(ptr), 0x1000);
+    return obj2hdr(ptr)->slab->size;
 }
\ No newline at end of file
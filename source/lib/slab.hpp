@@ -6,48 +6,132 @@
 #include <cstdint>
 #include <cstddef>
 
-struct slab_t
+static constexpr size_t slab_magazine_size = 32;
+static constexpr size_t slab_empty_reserve = 2;
+static constexpr size_t slab_max_order = 3;
+static constexpr size_t slab_colour_size = 64;
+
+struct slab_magazine_t
 {
-    lock_t lock;
-    uint64_t firstfree;
-    uint64_t size;
+    size_t count;
+    void *objects[slab_magazine_size];
+};
 
-    void init(uint64_t size);
-    void *alloc();
-    void free(void *ptr);
+struct [[gnu::aligned(64)]] slab_cpu_t
+{
+    slab_magazine_t *loaded;
+    slab_magazine_t *previous;
+    slab_magazine_t magazines[2];
 };
 
+struct slab_t;
 struct slabHdr
 {
     slab_t *slab;
+    slabHdr *next;
+    slabHdr *prev;
+
+    uint64_t base;
+
+    uint64_t firstfree;
+    size_t inuse;
+    size_t total;
 };
 
-class SlabAlloc
+struct slab_t
 {
-    private:
     lock_t lock;
+    const char *name = nullptr;
+    uint64_t size = 0;
+    size_t align = 0;
+    void (*ctor)(void *obj) = nullptr;
+    slab_t *hdrcache = nullptr;
+
+    // Derived from the above in init()
+    size_t stride = 0;
+    size_t order = 0;
+    size_t total = 0;
+    size_t offset = 0;
+    size_t freeoff = 0;
+    size_t colours = 1;
+    size_t colour = 0;
+
+    slabHdr *full = nullptr;
+    slabHdr *partial = nullptr;
+    slabHdr *empty = nullptr;
+    size_t emptycount = 0;
+    size_t pages = 0;
+
+    size_t allocs = 0;
+    size_t frees = 0;
+    uint64_t waited = 0;
 
-    struct bigallocMeta
+    slab_cpu_t *cpus = nullptr;
+    slab_t *next = nullptr;
+
+    slab_t() { };
+    slab_t(const char *name, uint64_t size, size_t align = 8, void (*ctor)(void *obj) = nullptr, slab_t *hdrcache = nullptr)
     {
-        size_t pages;
-        size_t size;
-    };
+        this->init(name, size, align, ctor, hdrcache);
+    }
+
+    // Objects without a constructor are zeroed on every allocation, objects with
+    // one are constructed once per slab and must be freed in their constructed state.
+    // If hdrcache is set, slab headers are allocated from it instead of taking up
+    // the start of every slab
+    void init(const char *name, uint64_t size, size_t align = 8, void (*ctor)(void *obj) = nullptr, slab_t *hdrcache = nullptr);
+    void init(uint64_t size, slab_t *hdrcache = nullptr);
+    void *alloc();
+    void free(void *ptr);
+
+    size_t reclaim();
+
+    private:
+    slab_cpu_t *get_cpu();
+    void acquire();
+    slabHdr *grow();
+    void release(slabHdr *hdr);
+    void *alloc_locked();
+    void free_locked(void *ptr);
+};
+
+// Returns empty slab pages of every slab to the PMM, returns the number of pages freed
+size_t slab_reclaim();
+
+// Calls func for every slab that has been initialised
+void slab_foreach(void (*func)(slab_t *slab));
+
+// Defines a typed object cache and class specific operator new and delete for type,
+// which must declare them as static members
+#define new_cache(name, type, ...) \
+    static slab_t name(#type, sizeof(type), alignof(type) __VA_OPT__(,) __VA_ARGS__); \
+    void *type::operator new(size_t) { return name.alloc(); } \
+    void type::operator delete(void *ptr) { name.free(ptr); }
+
+class SlabAlloc
+{
+    private:
+    lock_t lock;
 
-    slab_t *get_slab(size_t size);
+    slab_t *get_slab(size_t size, size_t align = 0);
 
-    void *big_malloc(size_t size);
+    void *big_malloc(size_t size, size_t align = 0x1000);
     void *big_realloc(void *oldptr, size_t size);
     void big_free(void *ptr);
     size_t big_allocsize(void *ptr);
 
     public:
-    slab_t slabs[10];
+    // Headers of the medium size classes
+    slab_t hdrs;
+    slab_t slabs[12];
 
     SlabAlloc();
 
     void *malloc(size_t size);
+    void *aligned_alloc(size_t align, size_t size);
     void *calloc(size_t num, size_t size);
     void *realloc(void *oldptr, size_t size);
     void free(void *ptr);
     size_t allocsize(void *ptr);
+    size_t sizeclass(void *ptr);
 };
\ No newline at end of file
@@ -36,7 +36,7 @@ MCFGHeader *mcfghdr;
 MADTHeader *madthdr;
 FADTHeader *fadthdr;
 HPETHeader *hpethdr;
-SDTHeader *rsdt;
+SDTHeader *rsdt = nullptr;
 
 vector<MADTLapic*> lapics;
 vector<MADTIOApic*> ioapics;
@@ -45,6 +45,14 @@ vector<MADTNmi*> nmis;
 
 uintptr_t lapic_addr = 0;
 
+size_t numa_node_count = 1;
+numa_range_t numa_ranges[max_numa_ranges];
+size_t numa_range_count = 0;
+
+static uint32_t numa_domains[max_numa_nodes];
+static uint8_t numa_distances[max_numa_nodes][max_numa_nodes];
+static uint8_t numa_cpus[256];
+
 void madt_init()
 {
     serial::newline();
@@ -78,6 +86,122 @@ void madt_init()
     }
 }
 
+static void rsdt_init()
+{
+    if (rsdt != nullptr) return;
+
+    rsdp = reinterpret_cast<RSDP*>(rsdp_request.response->address);
+
+    if (rsdp->revision >= 2 && rsdp->xsdtaddr)
+    {
+        use_xstd = true;
+        rsdt = reinterpret_cast<SDTHeader*>(rsdp->xsdtaddr);
+        log("Found XSDT at: 0x%X", rsdp->xsdtaddr);
+    }
+    else
+    {
+        use_xstd = false;
+        rsdt = reinterpret_cast<SDTHeader*>(rsdp->rsdtaddr);
+        log("Found RSDT at: 0x%X", rsdp->rsdtaddr);
+    }
+}
+
+static size_t domain2node(uint32_t domain)
+{
+    for (size_t i = 0; i < numa_node_count; i++)
+    {
+        if (numa_domains[i] == domain) return i;
+    }
+    if (numa_node_count == max_numa_nodes)
+    {
+        warn("ACPI/SRAT: Too many proximity domains, folding domain %d into node 0", domain);
+        return 0;
+    }
+    numa_domains[numa_node_count] = domain;
+    return numa_node_count++;
+}
+
+size_t numa_node(uint32_t lapic_id)
+{
+    if (lapic_id >= 256) return 0;
+    return numa_cpus[lapic_id];
+}
+
+uint8_t numa_distance(size_t from, size_t to)
+{
+    if (from >= numa_node_count || to >= numa_node_count) return 0xFF;
+    return numa_distances[from][to];
+}
+
+// Runs from pmm::init(), so it must not allocate
+void numa_init()
+{
+    rsdt_init();
+
+    for (size_t i = 0; i < max_numa_nodes; i++)
+    {
+        for (size_t t = 0; t < max_numa_nodes; t++) numa_distances[i][t] = (i == t) ? 10 : 20;
+    }
+
+    SRATHeader *srathdr = reinterpret_cast<SRATHeader*>(findtable("SRAT", 0));
+    if (srathdr == nullptr) return;
+
+    numa_node_count = 0;
+    for (uint8_t *srat_ptr = reinterpret_cast<uint8_t*>(srathdr->entries_begin); reinterpret_cast<uintptr_t>(srat_ptr) < reinterpret_cast<uintptr_t>(srathdr) + srathdr->sdt.length; srat_ptr += *(srat_ptr + 1))
+    {
+        if (*(srat_ptr + 1) == 0) break;
+        switch (*(srat_ptr))
+        {
+            case 0:
+            {
+                SRATLapic *lapic = reinterpret_cast<SRATLapic*>(srat_ptr);
+                if (!(lapic->flags & (1 << 0))) break;
+
+                uint32_t domain = lapic->domain_low | (lapic->domain_high[0] << 8) | (lapic->domain_high[1] << 16) | (lapic->domain_high[2] << 24);
+                numa_cpus[lapic->apic_id] = domain2node(domain);
+                break;
+            }
+            case 1:
+            {
+                SRATMemory *mem = reinterpret_cast<SRATMemory*>(srat_ptr);
+                if (!(mem->flags & (1 << 0)) || mem->length_bytes == 0) break;
+                if (numa_range_count == max_numa_ranges)
+                {
+                    warn("ACPI/SRAT: Too many memory ranges!");
+                    break;
+                }
+
+                numa_ranges[numa_range_count++] = numa_range_t { .base = mem->base, .length = mem->length_bytes, .node = domain2node(mem->domain) };
+                break;
+            }
+            case 2:
+            {
+                SRATX2Apic *x2apic = reinterpret_cast<SRATX2Apic*>(srat_ptr);
+                if (!(x2apic->flags & (1 << 0)) || x2apic->x2apic_id >= 256) break;
+
+                numa_cpus[x2apic->x2apic_id] = domain2node(x2apic->domain);
+                break;
+            }
+        }
+    }
+    if (numa_node_count == 0) numa_node_count = 1;
+
+    SLITHeader *slithdr = reinterpret_cast<SLITHeader*>(findtable("SLIT", 0));
+    if (slithdr != nullptr)
+    {
+        for (size_t i = 0; i < numa_node_count; i++)
+        {
+            for (size_t t = 0; t < numa_node_count; t++)
+            {
+                if (numa_domains[i] >= slithdr->locality_count || numa_domains[t] >= slithdr->locality_count) continue;
+                numa_distances[i][t] = slithdr->entries[numa_domains[i] * slithdr->locality_count + numa_domains[t]];
+            }
+        }
+    }
+
+    log("ACPI/SRAT: Found %zu NUMA nodes and %zu memory ranges", numa_node_count, numa_range_count);
+}
+
 void shutdown()
 {
     lai_enter_sleep(5);
@@ -121,20 +245,7 @@ void init()
         return;
     }
 
-    rsdp = reinterpret_cast<RSDP*>(rsdp_request.response->address);
-
-    if (rsdp->revision >= 2 && rsdp->xsdtaddr)
-    {
-        use_xstd = true;
-        rsdt = reinterpret_cast<SDTHeader*>(rsdp->xsdtaddr);
-        log("Found XSDT at: 0x%X", rsdp->xsdtaddr);
-    }
-    else
-    {
-        use_xstd = false;
-        rsdt = reinterpret_cast<SDTHeader*>(rsdp->rsdtaddr);
-        log("Found RSDT at: 0x%X", rsdp->rsdtaddr);
-    }
+    rsdt_init();
 
     mcfghdr = reinterpret_cast<MCFGHeader*>(findtable("MCFG", 0));
     madthdr = reinterpret_cast<MADTHeader*>(findtable("APIC", 0));
@@ -98,6 +98,68 @@ struct [[gnu::packed]] MADTNmi
     uint8_t lint;
 };
 
+struct [[gnu::packed]] SRATHeader
+{
+    SDTHeader sdt;
+    uint32_t reserved;
+    uint64_t reserved2;
+    char entries_begin[];
+};
+
+struct [[gnu::packed]] SRATLapic
+{
+    uint8_t type;
+    uint8_t length;
+    uint8_t domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t domain_high[3];
+    uint32_t clock_domain;
+};
+
+struct [[gnu::packed]] SRATMemory
+{
+    uint8_t type;
+    uint8_t length;
+    uint32_t domain;
+    uint16_t reserved;
+    uint64_t base;
+    uint64_t length_bytes;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+};
+
+struct [[gnu::packed]] SRATX2Apic
+{
+    uint8_t type;
+    uint8_t length;
+    uint16_t reserved;
+    uint32_t domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+};
+
+struct [[gnu::packed]] SLITHeader
+{
+    SDTHeader sdt;
+    uint64_t locality_count;
+    uint8_t entries[];
+};
+
+static constexpr size_t max_numa_nodes = 8;
+static constexpr size_t max_numa_ranges = 32;
+
+struct numa_range_t
+{
+    uint64_t base;
+    uint64_t length;
+    size_t node;
+};
+
 struct [[gnu::packed]] GenericAddressStructure
 {
     uint8_t AddressSpace;
@@ -197,6 +259,14 @@ extern vector<MADTNmi*> nmis;
 
 extern uintptr_t lapic_addr;
 
+extern size_t numa_node_count;
+extern numa_range_t numa_ranges[max_numa_ranges];
+extern size_t numa_range_count;
+
+size_t numa_node(uint32_t lapic_id);
+uint8_t numa_distance(size_t from, size_t to);
+void numa_init();
+
 void init();
 
 void shutdown();
@@ -121,47 +121,51 @@ static const char *exception_messages[32] = {
     "Reserved",
 };
 
-static volatile bool halt = true;
-static void exception_handler(registers_t *regs)
+// Resolves demand and copy on write faults without idt_lock or logging,
+// anything it can't resolve is reported by exception_handler
+static bool page_fault(registers_t *regs)
 {
-    lockit(idt_lock);
-
-    error("System exception!");
-    error("Exception: %s on CPU %zu", exception_messages[regs->int_no], (smp::initialised ? this_cpu->id : 0));
-    error("Address: 0x%lX", regs->rip);
-    error("Error code: 0x%lX, 0b%b", regs->error_code, regs->error_code);
+    uint64_t addr = 0;
+    asm volatile ("mov %%cr2, %0" : "=r"(addr));
 
-    switch (regs->int_no)
-    {
-        case 14:
-        {
-            uint64_t addr = 0;
-            asm volatile ("mov %%cr2, %0" : "=r"(addr));
+    vmm::Pagemap *pagemap = nullptr;
 
-            vmm::Pagemap *pagemap = nullptr;
+    auto proc = this_proc();
+    if (proc == nullptr) pagemap = vmm::kernel_pagemap;
+    else pagemap = proc->pagemap;
 
-            auto proc = this_proc();
-            if (proc == nullptr) pagemap = vmm::kernel_pagemap;
-            else pagemap = proc->pagemap;
+    vmm::fault_type type = pagemap->fault(addr, regs->error_code);
+    if (type == vmm::FaultNone) return false;
 
-            auto [range, mem_page, file_page] = pagemap->addr2range(addr);
-            if (range == nullptr) break;
-
-            void *page = nullptr;
-            if (range->flags & vmm::MapAnon) page = pmm::alloc();
-            else page = range->global->res->mmap(file_page, range->flags);
-
-            range->global->map_in_range(mem_page * vmm::page_size, reinterpret_cast<uint64_t>(page), range->prot);
-            halt = false;
+    if (smp::initialised)
+    {
+        vmm::fault_stats_t &faults = this_cpu->faults;
+        switch (type)
+        {
+            case vmm::FaultMinor:
+                faults.minor++;
+                break;
+            case vmm::FaultMajor:
+                faults.major++;
+                break;
+            case vmm::FaultCOW:
+                faults.cow++;
+                break;
+            default:
+                break;
         }
     }
+    return true;
+}
 
-    if (!halt)
-    {
-        trace::trace(false);
-        serial::newline();
-        return;
-    }
+static void exception_handler(registers_t *regs)
+{
+    lockit(idt_lock);
+
+    error("System exception!");
+    error("Exception: %s on CPU %zu", exception_messages[regs->int_no], (smp::initialised ? this_cpu->id : 0));
+    error("Address: 0x%lX", regs->rip);
+    error("Error code: 0x%lX, 0b%b", regs->error_code, regs->error_code);
 
     printf("\n[\033[31mPANIC\033[0m] System Exception!\n");
     printf("[\033[31mPANIC\033[0m] Exception: %s on CPU %zu\n", exception_messages[regs->int_no], (smp::initialised ? this_cpu->id : 0));
@@ -201,6 +205,7 @@ static void irq_handler(registers_t *regs)
 
 extern "C" void int_handler(registers_t *regs)
 {
+    if (regs->int_no == 14 && page_fault(regs)) return;
     if (regs->int_no < 32) exception_handler(regs);
     else if (regs->int_no >= 32 && regs->int_no < 256) irq_handler(regs);
     else panic("Unknown interrupt!");
@@ -7,6 +7,7 @@
 #include <system/cpu/smp/smp.hpp>
 #include <system/mm/pmm/pmm.hpp>
 #include <system/mm/vmm/vmm.hpp>
+#include <system/acpi/acpi.hpp>
 #include <kernel/kernel.hpp>
 #include <lib/alloc.hpp>
 #include <lib/panic.hpp>
@@ -16,6 +17,7 @@
 #include <cpuid.h>
 
 using namespace kernel::system::mm;
+using namespace kernel::system;
 
 namespace kernel::system::cpu::smp {
 
@@ -41,6 +43,7 @@ static void cpu_init(limine_smp_info *cpu)
     vmm::kernel_pagemap->switchTo();
 
     this_cpu->lapic_id = cpu->lapic_id;
+    this_cpu->node = acpi::numa_node(cpu->lapic_id);
     this_cpu->tss = &gdt::tss[this_cpu->id];
 
     enableSSE();
@@ -92,7 +95,7 @@ static void cpu_init(limine_smp_info *cpu)
     wrmsr(0xC0000082, reinterpret_cast<uint64_t>(syscall::syscall_entry));
     wrmsr(0xC0000084, ~static_cast<uint32_t>(0x02));
 
-    log("CPU %ld is up", this_cpu->id);
+    log("CPU %ld is up (NUMA node %zu)", this_cpu->id, this_cpu->node);
     this_cpu->is_up = true;
 
     cpu_lock.unlock();
@@ -114,6 +117,8 @@ void init()
         return;
     }
 
+    vmm::shootdown_init();
+
     for (size_t i = 0; i < smp_request.response->cpu_count; i++)
     {
         limine_smp_info *smp_info = smp_request.response->cpus[i];
@@ -4,6 +4,8 @@
 
 #include <system/sched/scheduler/scheduler.hpp>
 #include <system/cpu/gdt/gdt.hpp>
+#include <system/mm/pmm/pmm.hpp>
+#include <system/mm/vmm/vmm.hpp>
 #include <lib/errno.hpp>
 #include <cstddef>
 
@@ -11,10 +13,11 @@ using namespace kernel::system::sched;
 
 namespace kernel::system::cpu::smp {
 
-struct cpu_t
+struct [[gnu::aligned(64)]] cpu_t
 {
     uint64_t id;
     uint32_t lapic_id;
+    size_t node;
     gdt::TSS *tss;
 
     size_t fpu_storage_size;
@@ -27,6 +30,12 @@ struct cpu_t
 
     errno_t err;
 
+    mm::pmm::magazine_t frames;
+    uint64_t slab_wait;
+    mm::vmm::fault_stats_t faults;
+    // Set by Pagemap::shootdown, cleared once this CPU has flushed
+    bool shootdown;
+
     volatile bool is_up;
 };
 
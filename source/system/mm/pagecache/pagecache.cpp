@@ -0,0 +1,365 @@
+// Copyright (C) 2021-2022  ilobilo
+
+#include <system/mm/pagecache/pagecache.hpp>
+#include <system/mm/vmm/vmm.hpp>
+#include <kernel/kernel.hpp>
+#include <lib/memory.hpp>
+#include <lib/math.hpp>
+#include <lib/lock.hpp>
+#include <lib/log.hpp>
+
+namespace kernel::system::mm::pagecache {
+
+bool initialised = false;
+new_lock(cache_lock);
+
+// Hash chains are linked through page->priv, owner and index are the key.
+// Every cached page is also on a ring through lru_next and lru_prev that the clock hand sweeps
+static pmm::page_t *buckets[cache_buckets];
+static pmm::page_t *hand = nullptr;
+
+static size_t cached = 0;
+static size_t dirty = 0;
+
+static inline size_t hash(void *res, uint64_t index)
+{
+    return ((reinterpret_cast<uint64_t>(res) >> 4) * 0x9E3779B97F4A7C15 + index) % cache_buckets;
+}
+
+static inline uint8_t *page2virt(pmm::page_t *page)
+{
+    return reinterpret_cast<uint8_t*>(pmm::page2phys(page) + hhdm_offset);
+}
+
+static inline pmm::page_t *chain_next(pmm::page_t *page)
+{
+    return reinterpret_cast<pmm::page_t*>(page->priv);
+}
+
+// Length of the page that lies within the resource
+static inline uint64_t page_length(vfs::resource_t *res, uint64_t index)
+{
+    uint64_t offset = index * vmm::page_size;
+    uint64_t size = res->length();
+    if (offset >= size) return 0;
+    return (size - offset < vmm::page_size) ? size - offset : vmm::page_size;
+}
+
+static pmm::page_t *lookup(vfs::resource_t *res, uint64_t index)
+{
+    for (pmm::page_t *page = buckets[hash(res, index)]; page != nullptr; page = chain_next(page))
+    {
+        if (page->owner == res && page->index == index) return page;
+    }
+    return nullptr;
+}
+
+static void insert(pmm::page_t *page)
+{
+    size_t bucket = hash(page->owner, page->index);
+    page->priv = reinterpret_cast<uint64_t>(buckets[bucket]);
+    buckets[bucket] = page;
+
+    // Right behind the hand, so new pages are the last ones it looks at
+    if (hand == nullptr)
+    {
+        page->lru_next = page;
+        page->lru_prev = page;
+        hand = page;
+    }
+    else
+    {
+        page->lru_next = hand;
+        page->lru_prev = hand->lru_prev;
+        hand->lru_prev->lru_next = page;
+        hand->lru_prev = page;
+    }
+
+    page->flags |= pmm::PageCache | pmm::PageLRU;
+    cached++;
+}
+
+static void remove(pmm::page_t *page)
+{
+    size_t bucket = hash(page->owner, page->index);
+    if (buckets[bucket] == page) buckets[bucket] = chain_next(page);
+    else
+    {
+        pmm::page_t *prev = buckets[bucket];
+        while (chain_next(prev) != page) prev = chain_next(prev);
+        prev->priv = page->priv;
+    }
+
+    if (page->lru_next == page) hand = nullptr;
+    else
+    {
+        if (hand == page) hand = page->lru_next;
+        page->lru_prev->lru_next = page->lru_next;
+        page->lru_next->lru_prev = page->lru_prev;
+    }
+
+    if (page->flags & pmm::PageDirty) dirty--;
+    page->flags &= ~(pmm::PageCache | pmm::PageLRU | pmm::PageDirty | pmm::PageReferenced);
+    page->lru_next = nullptr;
+    page->lru_prev = nullptr;
+    page->owner = nullptr;
+    page->priv = 0;
+    cached--;
+}
+
+pmm::page_t *get(vfs::resource_t *res, uint64_t index, bool fill)
+{
+    cache_lock.lock();
+    pmm::page_t *page = lookup(res, index);
+    if (page != nullptr)
+    {
+        page->flags |= pmm::PageReferenced;
+        __atomic_add_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL);
+        cache_lock.unlock();
+        return page;
+    }
+    cache_lock.unlock();
+
+    // Read without the lock, the reclaim hook may run while the frame is allocated
+    void *frame = pmm::alloc();
+    if (frame == nullptr) return nullptr;
+
+    uint64_t length = page_length(res, index);
+    if (fill && length > 0 && !res->readpage(index * vmm::page_size, reinterpret_cast<uint8_t*>(frame) + hhdm_offset, length))
+    {
+        pmm::free(frame);
+        return nullptr;
+    }
+
+    lockit(cache_lock);
+    page = lookup(res, index);
+    if (page != nullptr)
+    {
+        page->flags |= pmm::PageReferenced;
+        __atomic_add_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL);
+        pmm::free(frame);
+        return page;
+    }
+
+    // One reference for the cache and one for the caller
+    page = pmm::phys2page(reinterpret_cast<uint64_t>(frame));
+    page->owner = res;
+    page->index = index;
+    __atomic_add_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL);
+    insert(page);
+
+    return page;
+}
+
+void put(pmm::page_t *page)
+{
+    pmm::unref(reinterpret_cast<void*>(pmm::page2phys(page)));
+}
+
+void mark_dirty(pmm::page_t *page)
+{
+    lockit(cache_lock);
+    if ((page->flags & pmm::PageCache) && !(page->flags & pmm::PageDirty))
+    {
+        page->flags |= pmm::PageDirty;
+        dirty++;
+    }
+}
+
+int64_t read(vfs::resource_t *res, uint8_t *buffer, uint64_t offset, uint64_t size)
+{
+    uint64_t end = res->length();
+    if (offset >= end) return 0;
+    if (offset + size > end) size = end - offset;
+
+    uint64_t done = 0;
+    while (done < size)
+    {
+        uint64_t index = (offset + done) / vmm::page_size;
+        uint64_t pageoff = (offset + done) % vmm::page_size;
+        uint64_t chunk = (vmm::page_size - pageoff < size - done) ? vmm::page_size - pageoff : size - done;
+
+        pmm::page_t *page = get(res, index);
+        if (page == nullptr)
+        {
+            errno_set(EIO);
+            return done ? done : -1;
+        }
+
+        memcpy(buffer + done, page2virt(page) + pageoff, chunk);
+        put(page);
+        done += chunk;
+    }
+    return done;
+}
+
+int64_t write(vfs::resource_t *res, uint8_t *buffer, uint64_t offset, uint64_t size)
+{
+    uint64_t done = 0;
+    while (done < size)
+    {
+        uint64_t index = (offset + done) / vmm::page_size;
+        uint64_t pageoff = (offset + done) % vmm::page_size;
+        uint64_t chunk = (vmm::page_size - pageoff < size - done) ? vmm::page_size - pageoff : size - done;
+
+        // Whole pages are overwritten, no need to read them first
+        pmm::page_t *page = get(res, index, chunk != vmm::page_size);
+        if (page == nullptr)
+        {
+            errno_set(EIO);
+            return done ? done : -1;
+        }
+
+        memcpy(page2virt(page) + pageoff, buffer + done, chunk);
+        mark_dirty(page);
+        put(page);
+        done += chunk;
+    }
+    return done;
+}
+
+void *mmap(vfs::resource_t *res, uint64_t index, int flags)
+{
+    pmm::page_t *page = get(res, index);
+    if (page == nullptr) return nullptr;
+
+    // Stores through the mapping can't be seen, so assume there will be some. sync keeps it dirty while mapped
+    if (flags & vmm::MapShared)
+    {
+        mark_dirty(page);
+        return reinterpret_cast<void*>(pmm::page2phys(page));
+    }
+
+    void *copy = pmm::alloc(1, pmm::AllocNoZero);
+    if (copy != nullptr) memcpy(reinterpret_cast<uint8_t*>(copy) + hhdm_offset, page2virt(page), vmm::page_size);
+    put(page);
+
+    return copy;
+}
+
+size_t sync(vfs::resource_t *res)
+{
+    size_t written = 0;
+
+    lockit(cache_lock);
+    pmm::page_t *page = hand;
+    for (size_t remaining = cached; page != nullptr && remaining > 0; remaining--)
+    {
+        pmm::page_t *next = page->lru_next;
+        if ((page->flags & pmm::PageDirty) && (res == nullptr || page->owner == res))
+        {
+            auto owner = static_cast<vfs::resource_t*>(page->owner);
+            uint64_t index = page->index;
+
+            __atomic_add_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL);
+            page->flags &= ~pmm::PageDirty;
+            dirty--;
+
+            cache_lock.unlock();
+            uint64_t length = page_length(owner, index);
+            bool success = (length == 0) || owner->writepage(index * vmm::page_size, page2virt(page), length);
+            cache_lock.lock();
+
+            if (success) written++;
+
+            // Besides the cache and this loop, only shared mappings hold on to a page for long.
+            // Stores through them can't be seen, so a page stays dirty for as long as it is mapped
+            bool mapped = __atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) > 2;
+            if ((!success || mapped) && (page->flags & pmm::PageCache) && !(page->flags & pmm::PageDirty))
+            {
+                page->flags |= pmm::PageDirty;
+                dirty++;
+            }
+
+            // It may have been dropped while the lock was released
+            next = (page->flags & pmm::PageCache) ? page->lru_next : nullptr;
+            put(page);
+        }
+        page = next;
+    }
+
+    return written;
+}
+
+void truncate(vfs::resource_t *res, uint64_t size)
+{
+    uint64_t first = DIV_ROUNDUP(size, vmm::page_size);
+
+    lockit(cache_lock);
+    pmm::page_t *page = hand;
+    for (size_t remaining = cached; page != nullptr && remaining > 0; remaining--)
+    {
+        pmm::page_t *next = (page->lru_next != page) ? page->lru_next : nullptr;
+        if (page->owner == res)
+        {
+            if (page->index >= first)
+            {
+                remove(page);
+                put(page);
+            }
+            else if (page->index == size / vmm::page_size && size % vmm::page_size)
+            {
+                memset(page2virt(page) + size % vmm::page_size, 0, vmm::page_size - size % vmm::page_size);
+            }
+        }
+        page = next;
+    }
+}
+
+void invalidate(vfs::resource_t *res)
+{
+    truncate(res, 0);
+}
+
+// Second chance sweep, evicts clean pages nobody but the cache references
+static size_t reclaim()
+{
+    size_t freed = 0;
+
+    lockit(cache_lock);
+    for (size_t scanned = 0, limit = cached * 2; hand != nullptr && scanned < limit && freed < reclaim_batch; scanned++)
+    {
+        pmm::page_t *page = hand;
+        hand = page->lru_next;
+
+        if (page->flags & pmm::PageReferenced)
+        {
+            page->flags &= ~pmm::PageReferenced;
+            continue;
+        }
+        if ((page->flags & pmm::PageDirty) || __atomic_load_n(&page->refcount, __ATOMIC_ACQUIRE) != 1) continue;
+
+        remove(page);
+        put(page);
+        freed++;
+    }
+
+    return freed;
+}
+
+size_t cachedpages()
+{
+    return cached;
+}
+
+size_t dirtypages()
+{
+    return dirty;
+}
+
+void init()
+{
+    log("Initialising page cache");
+
+    if (initialised)
+    {
+        warn("Page cache has already been initialised!\n");
+        return;
+    }
+
+    pmm::add_reclaim_hook(reclaim);
+
+    serial::newline();
+    initialised = true;
+}
+}
\ No newline at end of file
@@ -0,0 +1,40 @@
+// Copyright (C) 2021-2022  ilobilo
+
+#pragma once
+
+#include <system/mm/pmm/pmm.hpp>
+#include <system/vfs/vfs.hpp>
+#include <cstdint>
+#include <cstddef>
+
+namespace kernel::system::mm::pagecache {
+
+static constexpr size_t cache_buckets = 4096;
+static constexpr size_t reclaim_batch = 64;
+
+extern bool initialised;
+
+// Cached page index of res with a reference held, read in through res->readpage on a miss
+// unless fill is false, in which case it starts zeroed. Returns nullptr on I/O errors
+pmm::page_t *get(vfs::resource_t *res, uint64_t index, bool fill = true);
+void put(pmm::page_t *page);
+void mark_dirty(pmm::page_t *page);
+
+// Read and write res through the cache, bounded by res->length() for reads only
+int64_t read(vfs::resource_t *res, uint8_t *buffer, uint64_t offset, uint64_t size);
+int64_t write(vfs::resource_t *res, uint8_t *buffer, uint64_t offset, uint64_t size);
+// Physical frame for Pagemap::mmap with a reference held, shared mappings get the cached page itself
+void *mmap(vfs::resource_t *res, uint64_t index, int flags);
+
+// Writes back dirty pages of res, or of every resource if res is nullptr. Pages mapped shared stay dirty
+size_t sync(vfs::resource_t *res = nullptr);
+// Drops pages past size and zeroes the tail of the last one
+void truncate(vfs::resource_t *res, uint64_t size);
+// Drops every page of res without writing it back, pages still mapped stay with their mappers
+void invalidate(vfs::resource_t *res);
+
+size_t cachedpages();
+size_t dirtypages();
+
+void init();
+}
\ No newline at end of file
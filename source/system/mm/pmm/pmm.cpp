@@ -1,75 +1,718 @@
 // Copyright (C) 2021-2022  ilobilo
 
+#include <system/cpu/smp/smp.hpp>
+#include <system/sched/hpet/hpet.hpp>
 #include <system/mm/pmm/pmm.hpp>
+#include <system/mm/vmm/vmm.hpp>
+#include <system/acpi/acpi.hpp>
 #include <kernel/kernel.hpp>
+#include <lib/string.hpp>
 #include <lib/memory.hpp>
 #include <lib/panic.hpp>
 #include <lib/math.hpp>
 #include <lib/lock.hpp>
+#include <lib/cpu.hpp>
 #include <lib/log.hpp>
 
+using namespace kernel::system::cpu;
+
 namespace kernel::system::mm::pmm {
 
-Bitmap bitmap;
+struct freeblock_t
+{
+    freeblock_t *next;
+    freeblock_t *prev;
+};
+
+struct zone_t
+{
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+    size_t node;
+
+    freeblock_t *freelists[max_order];
+    size_t freecount[max_order];
+};
+
 bool initialised = false;
 static uintptr_t highest_addr = 0;
-static size_t lastI = 0;
 static size_t usedRam = 0;
 static size_t freeRam = 0;
 
+static page_t *pages = nullptr;
+static uint64_t page_count = 0;
+
+static constexpr size_t max_zones = acpi::max_numa_ranges * 2 + 4;
+
+static zone_t zones[max_zones];
+static size_t zone_count = 0;
+
+static size_t node_order[acpi::max_numa_nodes][acpi::max_numa_nodes];
+static size_t boot_node = 0;
+
+static void *zeroed[acpi::max_numa_nodes][zeroed_pool_size];
+static size_t zeroed_count[acpi::max_numa_nodes];
+
+struct huge_reserve_t
+{
+    size_t size;
+    size_t target;
+    size_t count;
+    void *frames[max_huge_reserve];
+};
+
+static huge_reserve_t huge_reserves[2] = { { .size = huge_2m_size }, { .size = huge_1g_size } };
+
+static constexpr size_t max_reclaim_hooks = 8;
+static reclaim_hook_t reclaim_hooks[max_reclaim_hooks];
+static size_t reclaim_hook_count = 0;
+
 new_lock(pmm_lock);
+new_lock(zeroed_lock);
+
+static inline size_t count2order(size_t count)
+{
+    if (count <= 1) return 0;
+    return 64 - __builtin_clzll(count - 1);
+}
+
+static inline freeblock_t *pfn2block(uint64_t pfn)
+{
+    return reinterpret_cast<freeblock_t*>(pfn * 0x1000 + hhdm_offset);
+}
+
+static inline uint64_t block2pfn(freeblock_t *block)
+{
+    return (reinterpret_cast<uint64_t>(block) - hhdm_offset) / 0x1000;
+}
+
+static zone_t *pfn2zone(uint64_t pfn)
+{
+    if (pfn >= page_count) return nullptr;
+
+    zone_t *zone = &zones[pages[pfn].zone];
+    if (pfn < zone->start || pfn >= zone->end) return nullptr;
+    return zone;
+}
+
+static void list_add(zone_t *zone, uint64_t pfn, size_t order)
+{
+    freeblock_t *block = pfn2block(pfn);
+    block->prev = nullptr;
+    block->next = zone->freelists[order];
+    if (block->next) block->next->prev = block;
+    zone->freelists[order] = block;
+    zone->freecount[order]++;
+    pages[pfn].order = order + 1;
+}
+
+static void list_remove(zone_t *zone, uint64_t pfn, size_t order)
+{
+    freeblock_t *block = pfn2block(pfn);
+    if (block->prev) block->prev->next = block->next;
+    else zone->freelists[order] = block->next;
+    if (block->next) block->next->prev = block->prev;
+    zone->freecount[order]--;
+    pages[pfn].order = 0;
+}
+
+static void free_block(zone_t *zone, uint64_t pfn, size_t order)
+{
+    while (order < max_order - 1)
+    {
+        uint64_t buddy = pfn ^ (1UL << order);
+        if (buddy < zone->start || buddy + (1UL << order) > zone->end) break;
+        if (pages[buddy].order != order + 1) break;
+
+        list_remove(zone, buddy, order);
+        pfn &= ~(1UL << order);
+        order++;
+    }
+    list_add(zone, pfn, order);
+}
+
+static void free_range(uint64_t pfn, size_t count)
+{
+    while (count > 0)
+    {
+        zone_t *zone = pfn2zone(pfn);
+        if (zone == nullptr) return;
+
+        size_t order = (pfn == 0) ? max_order - 1 : __builtin_ctzll(pfn);
+        while (order >= max_order || (1UL << order) > count || pfn + (1UL << order) > zone->end) order--;
+
+        free_block(zone, pfn, order);
+        pfn += 1UL << order;
+        count -= 1UL << order;
+    }
+}
 
-static void *inner_alloc(size_t count, size_t limit)
+static void *split_block(zone_t *zone, uint64_t pfn, size_t curr, size_t order, size_t count)
 {
-    size_t p = 0;
+    list_remove(zone, pfn, curr);
 
-    while (lastI < limit)
+    while (curr > order)
     {
-        if (!bitmap[lastI++])
+        curr--;
+        list_add(zone, pfn + (1UL << curr), curr);
+    }
+
+    if (count < (1UL << order)) free_range(pfn + count, (1UL << order) - count);
+    return reinterpret_cast<void*>(pfn * 0x1000);
+}
+
+static void *alloc_block(zone_t *zone, size_t count)
+{
+    size_t order = count2order(count);
+    if (order >= max_order) return nullptr;
+
+    size_t curr = order;
+    while (curr < max_order && zone->freelists[curr] == nullptr) curr++;
+    if (curr == max_order) return nullptr;
+
+    return split_block(zone, block2pfn(zone->freelists[curr]), curr, order, count);
+}
+
+static void *alloc_block_below(zone_t *zone, size_t count, size_t order, uint64_t max_pfn)
+{
+    for (size_t curr = order; curr < max_order; curr++)
+    {
+        for (freeblock_t *block = zone->freelists[curr]; block != nullptr; block = block->next)
         {
-            if (++p == count)
-            {
-                size_t page = lastI - count;
-                for (size_t i = page; i < lastI; i++) bitmap.Set(i, true);
-                return reinterpret_cast<void*>(page * 0x1000);
-            }
+            uint64_t pfn = block2pfn(block);
+            if (pfn + count <= max_pfn) return split_block(zone, pfn, curr, order, count);
         }
-        else p = 0;
     }
     return nullptr;
 }
 
-void *alloc(size_t count)
+static inline size_t local_node()
+{
+    return smp::initialised ? this_cpu->node : boot_node;
+}
+
+static void *alloc_zones(size_t count)
+{
+    size_t local = local_node();
+    for (size_t n = 0; n < acpi::numa_node_count; n++)
+    {
+        size_t node = node_order[local][n];
+        for (size_t i = zone_count; i > 0; i--)
+        {
+            if (zones[i - 1].node != node) continue;
+
+            void *ret = alloc_block(&zones[i - 1], count);
+            if (ret != nullptr) return ret;
+        }
+    }
+    return nullptr;
+}
+
+static void magazine_drain(magazine_t *mag, size_t count)
+{
+    while (count-- > 0 && mag->count > 0)
+    {
+        free_range(reinterpret_cast<uint64_t>(mag->pages[--mag->count]) / 0x1000, 1);
+    }
+}
+
+static void *magazine_alloc()
+{
+    bool ints = interrupts_enabled();
+    asm volatile ("cli");
+
+    auto mag = &this_cpu->frames;
+    if (mag->count == 0)
+    {
+        mag->alloc_misses++;
+
+        pmm_lock.lock();
+        while (mag->count < magazine_batch)
+        {
+            void *page = alloc_zones(1);
+            if (page == nullptr) break;
+            mag->pages[mag->count++] = page;
+        }
+        pmm_lock.unlock();
+    }
+    else mag->alloc_hits++;
+
+    void *ret = (mag->count > 0) ? mag->pages[--mag->count] : nullptr;
+
+    if (ints) asm volatile ("sti");
+    return ret;
+}
+
+static void magazine_free(void *ptr)
+{
+    bool ints = interrupts_enabled();
+    asm volatile ("cli");
+
+    auto mag = &this_cpu->frames;
+    if (mag->count == magazine_size)
+    {
+        mag->free_misses++;
+
+        pmm_lock.lock();
+        magazine_drain(mag, magazine_batch);
+        pmm_lock.unlock();
+    }
+    else mag->free_hits++;
+
+    mag->pages[mag->count++] = ptr;
+
+    if (ints) asm volatile ("sti");
+}
+
+static void *zeroed_pop()
+{
+    bool ints = interrupts_enabled();
+    asm volatile ("cli");
+
+    size_t node = local_node();
+    void *ret = nullptr;
+    if (zeroed_count[node] > 0)
+    {
+        zeroed_lock.lock();
+        if (zeroed_count[node] > 0) ret = zeroed[node][--zeroed_count[node]];
+        zeroed_lock.unlock();
+    }
+
+    if (ints) asm volatile ("sti");
+    return ret;
+}
+
+static bool zeroed_push(size_t node, void *page)
+{
+    bool ints = interrupts_enabled();
+    asm volatile ("cli");
+
+    bool ret = false;
+    zeroed_lock.lock();
+    if (zeroed_count[node] < zeroed_pool_size)
+    {
+        zeroed[node][zeroed_count[node]++] = page;
+        ret = true;
+    }
+    zeroed_lock.unlock();
+
+    if (ints) asm volatile ("sti");
+    return ret;
+}
+
+static void zeroed_drain()
+{
+    bool ints = interrupts_enabled();
+    asm volatile ("cli");
+
+    zeroed_lock.lock();
+    for (size_t i = 0; i < acpi::numa_node_count; i++)
+    {
+        while (zeroed_count[i] > 0) free_range(reinterpret_cast<uint64_t>(zeroed[i][--zeroed_count[i]]) / 0x1000, 1);
+    }
+    zeroed_lock.unlock();
+
+    if (ints) asm volatile ("sti");
+}
+
+static inline bool movable(uint64_t pfn)
+{
+    page_t &page = pages[pfn];
+    return (page.flags & PageAnon) && !(page.flags & (PageLocked | PageReserved | PageCOW)) && page.owner != nullptr && page.refcount == 1;
+}
+
+static bool compactable(uint64_t pfn, size_t order)
+{
+    for (uint64_t p = pfn; p < pfn + (1UL << order);)
+    {
+        if (pages[p].order != 0)
+        {
+            if (static_cast<size_t>(pages[p].order - 1) >= order) return false;
+            p += 1UL << (pages[p].order - 1);
+        }
+        else if (movable(p)) p++;
+        else return false;
+    }
+    return true;
+}
+
+// Migrates movable pages out of one block of the given order, caller holds pmm_lock
+static size_t compact_block(zone_t *zone, uint64_t pfn, size_t order, bool &success)
+{
+    size_t moved = 0;
+    success = true;
+
+    // Take every free part of the block off the free lists first, so no destination can come from inside it
+    for (uint64_t p = pfn; p < pfn + (1UL << order);)
+    {
+        if (pages[p].order == 0)
+        {
+            p++;
+            continue;
+        }
+
+        size_t o = pages[p].order - 1;
+        list_remove(zone, p, o);
+        pages[p].flags |= PageIsolated;
+        pages[p].priv = o;
+        p += 1UL << o;
+    }
+
+    for (uint64_t p = pfn; p < pfn + (1UL << order);)
+    {
+        if (pages[p].flags & PageIsolated)
+        {
+            p += 1UL << pages[p].priv;
+            continue;
+        }
+
+        void *dest = success ? alloc_zones(1) : nullptr;
+        if (dest == nullptr || !movable(p) || !vmm::migrate_page(&pages[p], reinterpret_cast<uint64_t>(dest)))
+        {
+            if (dest != nullptr) free_range(reinterpret_cast<uint64_t>(dest) / 0x1000, 1);
+            success = false;
+            p++;
+            continue;
+        }
+
+        page_t &newpage = pages[reinterpret_cast<uint64_t>(dest) / 0x1000];
+        newpage.owner = pages[p].owner;
+        newpage.index = pages[p].index;
+        newpage.refcount = pages[p].refcount;
+        newpage.flags = pages[p].flags;
+
+        pages[p].owner = nullptr;
+        pages[p].refcount = 0;
+        pages[p].flags = PageIsolated;
+        pages[p].priv = 0;
+        moved++;
+        p++;
+    }
+
+    for (uint64_t p = pfn; p < pfn + (1UL << order);)
+    {
+        if (!(pages[p].flags & PageIsolated))
+        {
+            p++;
+            continue;
+        }
+
+        size_t o = pages[p].priv;
+        pages[p].flags &= ~PageIsolated;
+        pages[p].priv = 0;
+        free_block(zone, p, o);
+        p += 1UL << o;
+    }
+    return moved;
+}
+
+static bool compact(size_t order, uint64_t max_pfn)
+{
+    if (order == 0 || order >= max_order) return false;
+
+    uint64_t start = hpet::initialised ? hpet::nanos() : 0;
+    size_t moved = 0;
+    bool success = false;
+
+    for (size_t i = zone_count; i > 0 && !success; i--)
+    {
+        zone_t *zone = &zones[i - 1];
+        for (uint64_t pfn = ALIGN_UP(zone->start, 1UL << order); pfn + (1UL << order) <= zone->end && pfn + (1UL << order) <= max_pfn; pfn += 1UL << order)
+        {
+            if (!compactable(pfn, order)) continue;
+
+            moved += compact_block(zone, pfn, order, success);
+            if (success) break;
+        }
+    }
+
+    uint64_t time = hpet::initialised ? hpet::nanos() - start : 0;
+    log("PMM: Compaction for order %zu %s, moved %zu pages in %lu us", order, success ? "succeeded" : "failed", moved, time / 1000);
+    return success;
+}
+
+static size_t run_reclaim_hooks()
+{
+    size_t count = __atomic_load_n(&reclaim_hook_count, __ATOMIC_ACQUIRE);
+    size_t ret = 0;
+    for (size_t i = 0; i < count; i++) ret += reclaim_hooks[i]();
+    return ret;
+}
+
+static void *alloc_pages_locked(size_t count, bool compaction, bool drain = true)
 {
     lockit(pmm_lock);
 
-    size_t i = lastI;
-    void *ret = inner_alloc(count, highest_addr / 0x1000);
+    void *ret = alloc_zones(count);
+    if (ret == nullptr && smp::initialised)
+    {
+        bool ints = interrupts_enabled();
+        asm volatile ("cli");
+        auto mag = &this_cpu->frames;
+        magazine_drain(mag, mag->count);
+        if (ints) asm volatile ("sti");
+
+        ret = alloc_zones(count);
+    }
+    if (ret == nullptr && drain)
+    {
+        zeroed_drain();
+        ret = alloc_zones(count);
+    }
+    if (ret == nullptr && compaction && count > 1 && compact(count2order(count), page_count)) ret = alloc_zones(count);
+    return ret;
+}
+
+// Without reclaim nothing is taken back from the zeroed pool or the reclaim hooks
+static void *alloc_pages(size_t count, bool reclaim = true)
+{
+    void *ret = nullptr;
+    if (count == 1 && smp::initialised) ret = magazine_alloc();
+    if (ret != nullptr) return ret;
+
+    ret = alloc_pages_locked(count, false, reclaim);
+
+    // Hooks free memory through pmm::free, so they must run without pmm_lock held
+    if (ret == nullptr && reclaim)
+    {
+        size_t reclaimed = run_reclaim_hooks();
+        if (reclaimed > 0) log("PMM: Reclaimed %zu pages", reclaimed);
+        ret = alloc_pages_locked(count, true);
+    }
+    return ret;
+}
+
+static void *alloc_zones_below(size_t count, size_t order, uint64_t max_pfn)
+{
+    size_t local = local_node();
+    for (size_t n = 0; n < acpi::numa_node_count; n++)
+    {
+        size_t node = node_order[local][n];
+        for (size_t i = zone_count; i > 0; i--)
+        {
+            if (zones[i - 1].node != node || zones[i - 1].start + count > max_pfn) continue;
+
+            void *ret = alloc_block_below(&zones[i - 1], count, order, max_pfn);
+            if (ret != nullptr) return ret;
+        }
+    }
+    return nullptr;
+}
+
+static void *alloc_constrained_locked(size_t count, size_t order, uint64_t max_pfn)
+{
+    lockit(pmm_lock);
+
+    void *ret = alloc_zones_below(count, order, max_pfn);
     if (ret == nullptr)
     {
-        lastI = 0;
-        ret = inner_alloc(count, i);
+        if (smp::initialised)
+        {
+            bool ints = interrupts_enabled();
+            asm volatile ("cli");
+            auto mag = &this_cpu->frames;
+            magazine_drain(mag, mag->count);
+            if (ints) asm volatile ("sti");
+        }
+        zeroed_drain();
+
+        ret = alloc_zones_below(count, order, max_pfn);
+    }
+    if (ret == nullptr && compact(order, max_pfn)) ret = alloc_zones_below(count, order, max_pfn);
+    return ret;
+}
+
+static void free_pages(void *ptr, size_t count)
+{
+    zone_t *zone = pfn2zone(reinterpret_cast<uint64_t>(ptr) / 0x1000);
+    if (zone == nullptr) return;
+
+    if (count == 1 && smp::initialised && zone->node == this_cpu->node) magazine_free(ptr);
+    else
+    {
+        lockit(pmm_lock);
+        free_range(reinterpret_cast<uint64_t>(ptr) / 0x1000, count);
+    }
+}
+
+static void init_pages(void *ptr, size_t count)
+{
+    page_t *page = &pages[reinterpret_cast<uint64_t>(ptr) / 0x1000];
+    for (size_t i = 0; i < count; i++, page++)
+    {
+        page->lru_next = page->lru_prev = nullptr;
+        page->owner = nullptr;
+        page->index = 0;
+        page->refcount = 1;
+        page->flags = 0;
+        page->priv = 0;
+    }
+}
+
+void *alloc(size_t count, int flags)
+{
+    if (count == 0) return nullptr;
+
+    void *ret = nullptr;
+    if (count == 1 && !(flags & AllocNoZero)) ret = zeroed_pop();
+
+    if (ret == nullptr)
+    {
+        ret = alloc_pages(count);
         if (ret == nullptr) panic("Out of memory!");
+
+        if (!(flags & AllocNoZero)) memset(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(ret) + hhdm_offset), 0, count * 0x1000);
     }
-    memset(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(ret) + hhdm_offset), 0, count * 0x1000);
+    init_pages(ret, count);
 
-    usedRam += count * 0x1000;
-    freeRam -= count * 0x1000;
+    __atomic_add_fetch(&usedRam, count * 0x1000, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&freeRam, count * 0x1000, __ATOMIC_RELAXED);
 
     return ret;
 }
 
+void *alloc_constrained(size_t count, uint64_t max_addr, size_t align, size_t boundary, int flags)
+{
+    if (count == 0) return nullptr;
+    assert(align != 0 && (align & (align - 1)) == 0, "PMM: Alignment must be a power of two!");
+    assert((boundary & (boundary - 1)) == 0, "PMM: Boundary must be a power of two!");
+
+    // Buddy blocks are naturally aligned, so a block of at least the alignment that is
+    // no larger than the boundary can never cross it
+    if (boundary != 0 && count * 0x1000 > boundary) return nullptr;
+
+    size_t order = count2order(count);
+    if (align > 0x1000 && count2order(align / 0x1000) > order) order = count2order(align / 0x1000);
+    if (order >= max_order) return nullptr;
+
+    void *ret = alloc_constrained_locked(count, order, max_addr / 0x1000);
+
+    // Same as alloc_pages, the hooks must run without pmm_lock held
+    if (ret == nullptr)
+    {
+        size_t reclaimed = run_reclaim_hooks();
+        if (reclaimed > 0)
+        {
+            log("PMM: Reclaimed %zu pages", reclaimed);
+            ret = alloc_constrained_locked(count, order, max_addr / 0x1000);
+        }
+    }
+    if (ret == nullptr) return nullptr;
+
+    if (!(flags & AllocNoZero)) memset(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(ret) + hhdm_offset), 0, count * 0x1000);
+    init_pages(ret, count);
+
+    __atomic_add_fetch(&usedRam, count * 0x1000, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&freeRam, count * 0x1000, __ATOMIC_RELAXED);
+
+    return ret;
+}
+
+static huge_reserve_t *size2reserve(size_t size)
+{
+    for (auto &reserve : huge_reserves)
+    {
+        if (reserve.size == size) return &reserve;
+    }
+    return nullptr;
+}
+
+void *alloc_huge(size_t size, int flags)
+{
+    huge_reserve_t *reserve = size2reserve(size);
+    if (reserve == nullptr) return nullptr;
+
+    void *ret = nullptr;
+    {
+        lockit(pmm_lock);
+        if (reserve->count > 0) ret = reserve->frames[--reserve->count];
+    }
+
+    if (ret != nullptr)
+    {
+        if (!(flags & AllocNoZero)) memset(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(ret) + hhdm_offset), 0, size);
+        init_pages(ret, size / 0x1000);
+    }
+    else
+    {
+        ret = alloc_constrained(size / 0x1000, ~0UL, size, 0, flags);
+        if (ret == nullptr) return nullptr;
+    }
+
+    pages[reinterpret_cast<uint64_t>(ret) / 0x1000].flags |= PageHuge;
+    return ret;
+}
+
+void free_huge(void *ptr, size_t size)
+{
+    huge_reserve_t *reserve = size2reserve(size);
+    if (ptr == nullptr || reserve == nullptr) return;
+
+    {
+        lockit(pmm_lock);
+        if (reserve->count < reserve->target)
+        {
+            for (size_t i = 0; i < size / 0x1000; i++)
+            {
+                pages[reinterpret_cast<uint64_t>(ptr) / 0x1000 + i].refcount = 0;
+                pages[reinterpret_cast<uint64_t>(ptr) / 0x1000 + i].flags = 0;
+            }
+            reserve->frames[reserve->count++] = ptr;
+            return;
+        }
+    }
+    free(ptr, size / 0x1000);
+}
+
+size_t hugereserved(size_t size)
+{
+    huge_reserve_t *reserve = size2reserve(size);
+    return reserve ? reserve->count : 0;
+}
+
 void free(void *ptr, size_t count)
 {
-    if (ptr == nullptr) return;
-    lockit(pmm_lock);
+    if (ptr == nullptr || count == 0) return;
+
+    uint64_t pfn = reinterpret_cast<uint64_t>(ptr) / 0x1000;
+    if (pfn >= page_count) return;
+    if (pfn + count > page_count) count = page_count - pfn;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        pages[pfn + i].refcount = 0;
+        pages[pfn + i].flags = 0;
+    }
+    free_pages(ptr, count);
+
+    __atomic_sub_fetch(&usedRam, count * 0x1000, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&freeRam, count * 0x1000, __ATOMIC_RELAXED);
+}
 
-    size_t page = reinterpret_cast<size_t>(ptr) / 0x1000;
-    for (size_t i = page; i < page + count; i++) bitmap.Set(i, false);
-    if (lastI > page) lastI = page;
+page_t *phys2page(uint64_t phys)
+{
+    if (phys / 0x1000 >= page_count) return nullptr;
+    return &pages[phys / 0x1000];
+}
 
-    usedRam -= count * 0x1000;
-    freeRam += count * 0x1000;
+uint64_t page2phys(page_t *page)
+{
+    return (page - pages) * 0x1000;
+}
+
+void ref(void *ptr)
+{
+    page_t *page = phys2page(reinterpret_cast<uint64_t>(ptr));
+    if (page == nullptr) return;
+    __atomic_add_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL);
+}
+
+void unref(void *ptr)
+{
+    page_t *page = phys2page(reinterpret_cast<uint64_t>(ptr));
+    if (page == nullptr) return;
+    if (__atomic_sub_fetch(&page->refcount, 1, __ATOMIC_ACQ_REL) == 0) free(ptr);
 }
 
 void *realloc(void *ptr, size_t oldcount, size_t newcount)
@@ -82,14 +725,22 @@ void *realloc(void *ptr, size_t oldcount, size_t newcount)
         return nullptr;
     }
 
-    if (newcount < oldcount) oldcount = newcount;
+    size_t copycount = (newcount < oldcount) ? newcount : oldcount;
 
-    void *newptr = alloc(newcount);
-    memcpy(newptr, ptr, oldcount);
-    free(ptr);
+    void *newptr = alloc(newcount, (newcount > oldcount) ? AllocNone : AllocNoZero);
+    memcpy(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(newptr) + hhdm_offset), reinterpret_cast<void*>(reinterpret_cast<uint64_t>(ptr) + hhdm_offset), copycount * 0x1000);
+    free(ptr, oldcount);
     return newptr;
 }
 
+void add_reclaim_hook(reclaim_hook_t hook)
+{
+    lockit(pmm_lock);
+    assert(reclaim_hook_count < max_reclaim_hooks, "PMM: Too many reclaim hooks!");
+    reclaim_hooks[reclaim_hook_count] = hook;
+    __atomic_store_n(&reclaim_hook_count, reclaim_hook_count + 1, __ATOMIC_RELEASE);
+}
+
 size_t freemem()
 {
     return freeRam;
@@ -100,6 +751,69 @@ size_t usedmem()
     return usedRam;
 }
 
+size_t freeblocks(size_t order)
+{
+    if (order >= max_order) return 0;
+    lockit(pmm_lock);
+
+    size_t ret = 0;
+    for (size_t i = 0; i < zone_count; i++) ret += zones[i].freecount[order];
+    return ret;
+}
+
+size_t zeroedpages()
+{
+    size_t ret = 0;
+    for (size_t i = 0; i < acpi::numa_node_count; i++) ret += zeroed_count[i];
+    return ret;
+}
+
+void refill_zeroed()
+{
+    size_t node = local_node();
+    while (zeroed_count[node] < zeroed_pool_size)
+    {
+        // Leave the rest to real allocations, pool pages still count as free
+        if (__atomic_load_n(&freeRam, __ATOMIC_RELAXED) / 0x1000 < zeroedpages() + zeroed_watermark) return;
+
+        void *page = alloc_pages(1, false);
+        if (page == nullptr) return;
+
+        memset(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(page) + hhdm_offset), 0, 0x1000);
+        if (pfn2zone(reinterpret_cast<uint64_t>(page) / 0x1000)->node != node || zeroed_push(node, page) == false)
+        {
+            free_pages(page, 1);
+            return;
+        }
+    }
+}
+
+static void add_zone(uint64_t start, uint64_t end, size_t node)
+{
+    if (end > page_count) end = page_count;
+    if (start >= end) return;
+
+    if (start < dma32_limit / 0x1000 && end > dma32_limit / 0x1000)
+    {
+        add_zone(start, dma32_limit / 0x1000, node);
+        start = dma32_limit / 0x1000;
+    }
+
+    if (zone_count == max_zones)
+    {
+        warn("PMM: Too many zones, ignoring 0x%lX-0x%lX", start * 0x1000, end * 0x1000);
+        return;
+    }
+
+    size_t i = zone_count++;
+    while (i > 0 && zones[i - 1].start > start)
+    {
+        zones[i] = zones[i - 1];
+        i--;
+    }
+    zones[i] = zone_t { .name = (end <= dma32_limit / 0x1000) ? "DMA32" : "Normal", .start = start, .end = end, .node = node };
+}
+
 void init()
 {
     log("Initialising PMM");
@@ -118,37 +832,121 @@ void init()
         if (memmaps[i]->type != LIMINE_MEMMAP_USABLE) continue;
 
         uintptr_t top = memmaps[i]->base + memmaps[i]->length;
-        freeRam += memmaps[i]->length;
-
         if (top > highest_addr) highest_addr = top;
     }
 
-    size_t bitmapSize = ALIGN_UP((highest_addr / 0x1000) / 8, 0x1000);
+    page_count = highest_addr / 0x1000;
+    size_t pagesSize = ALIGN_UP(page_count * sizeof(page_t), 0x1000);
+    uint64_t pagesBase = 0;
 
     for (size_t i = 0; i < memmap_count; i++)
     {
         if (memmaps[i]->type != LIMINE_MEMMAP_USABLE) continue;
 
-        if (memmaps[i]->length >= bitmapSize)
+        if (memmaps[i]->length >= pagesSize)
         {
-            bitmap.buffer = reinterpret_cast<uint8_t*>(memmaps[i]->base);
-            memset(bitmap.buffer, 0xFF, bitmapSize);
-
-            memmaps[i]->length -= bitmapSize;
-            memmaps[i]->base += bitmapSize;
-            freeRam -= bitmapSize;
+            pagesBase = memmaps[i]->base;
+            pages = reinterpret_cast<page_t*>(pagesBase + hhdm_offset);
+            memset(pages, 0, pagesSize);
             break;
         }
     }
+    assert(pages != nullptr, "PMM: Could not find space for page descriptors!");
+
+    acpi::numa_init();
+    boot_node = acpi::numa_node(smp_request.response->bsp_lapic_id);
+
+    for (size_t i = 0; i < acpi::numa_range_count; i++)
+    {
+        uint64_t start = DIV_ROUNDUP(acpi::numa_ranges[i].base, 0x1000);
+        uint64_t end = (acpi::numa_ranges[i].base + acpi::numa_ranges[i].length) / 0x1000;
+        add_zone(start, end, acpi::numa_ranges[i].node);
+    }
+
+    // Memory not described by SRAT (or all of it, if there is no SRAT) goes to the boot node
+    uint64_t gaps[acpi::max_numa_ranges + 2][2];
+    size_t gap_count = 0;
+    uint64_t prev = 0;
+    for (size_t i = 0; i <= zone_count; i++)
+    {
+        uint64_t next = (i < zone_count) ? zones[i].start : page_count;
+        if (next > prev)
+        {
+            gaps[gap_count][0] = prev;
+            gaps[gap_count++][1] = next;
+        }
+        if (i < zone_count && zones[i].end > prev) prev = zones[i].end;
+    }
+    for (size_t i = 0; i < gap_count; i++) add_zone(gaps[i][0], gaps[i][1], boot_node);
+
+    for (size_t i = 0; i < acpi::numa_node_count; i++)
+    {
+        for (size_t t = 0; t < acpi::numa_node_count; t++)
+        {
+            size_t n = t;
+            while (n > 0 && acpi::numa_distance(i, node_order[i][n - 1]) > acpi::numa_distance(i, t))
+            {
+                node_order[i][n] = node_order[i][n - 1];
+                n--;
+            }
+            node_order[i][n] = t;
+        }
+    }
+
+    for (size_t i = 0; i < zone_count; i++)
+    {
+        for (uint64_t pfn = zones[i].start; pfn < zones[i].end; pfn++)
+        {
+            pages[pfn].flags = PageReserved;
+            pages[pfn].node = zones[i].node;
+            pages[pfn].zone = i;
+        }
+    }
 
     for (size_t i = 0; i < memmap_count; i++)
     {
         if (memmaps[i]->type != LIMINE_MEMMAP_USABLE) continue;
 
-        for (uintptr_t t = 0; t < memmaps[i]->length; t += 0x1000)
+        uint64_t base = memmaps[i]->base;
+        uint64_t length = memmaps[i]->length;
+        if (base == pagesBase)
+        {
+            base += pagesSize;
+            length -= pagesSize;
+        }
+
+        for (uint64_t pfn = base / 0x1000; pfn < (base + length) / 0x1000; pfn++) pages[pfn].flags &= ~PageReserved;
+        free_range(base / 0x1000, length / 0x1000);
+        freeRam += length;
+    }
+
+    // Huge frames are easiest to find before anything fragments memory
+    const char *reserve_args[2] = { "hugepages2m=", "hugepages1g=" };
+    for (size_t i = 0; i < 2; i++)
+    {
+        const char *arg = strstr(cmdline, reserve_args[i]);
+        if (arg == nullptr) continue;
+
+        size_t target = strtol(arg + strlen(reserve_args[i]), nullptr, 10);
+        if (target > max_huge_reserve) target = max_huge_reserve;
+
+        huge_reserve_t &reserve = huge_reserves[i];
+        reserve.target = target;
+        while (reserve.count < reserve.target)
         {
-            bitmap.Set((memmaps[i]->base + t) / 0x1000, false);
+            void *frame = alloc_zones_below(reserve.size / 0x1000, count2order(reserve.size / 0x1000), ~0UL / 0x1000);
+            if (frame == nullptr) break;
+
+            reserve.frames[reserve.count++] = frame;
+            freeRam -= reserve.size;
+            usedRam += reserve.size;
         }
+        log("PMM: Reserved %zu/%zu %zu MB huge frames", reserve.count, reserve.target, reserve.size / 1024 / 1024);
+    }
+
+    for (size_t i = 0; i < zone_count; i++)
+    {
+        log("PMM: Zone %s (node %zu): 0x%lX-0x%lX", zones[i].name, zones[i].node, zones[i].start * 0x1000, zones[i].end * 0x1000);
     }
 
     serial::newline();
@@ -2,28 +2,120 @@
 
 #pragma once
 
-#include <lib/bitmap.hpp>
 #include <limine.h>
 #include <cstdint>
+#include <cstddef>
 
 namespace kernel::system::mm::pmm {
 
-extern Bitmap bitmap;
+static constexpr size_t max_order = 19;
+static constexpr size_t magazine_size = 64;
+static constexpr size_t magazine_batch = 16;
+static constexpr size_t zeroed_pool_size = 256;
+static constexpr size_t zeroed_watermark = 1024;
+static constexpr uint64_t dma32_limit = 0x100000000;
+
+static constexpr size_t huge_2m_size = 0x200000;
+static constexpr size_t huge_1g_size = 0x40000000;
+static constexpr size_t max_huge_reserve = 64;
+
+enum pageflags
+{
+    PageReserved = (1 << 0),
+    PageSlab = (1 << 1),
+    PageAnon = (1 << 2),
+    PageCache = (1 << 3),
+    PageDirty = (1 << 4),
+    PageLocked = (1 << 5),
+    PageLRU = (1 << 6),
+    PageCOW = (1 << 7),
+    PageHuge = (1 << 8),
+    PageIsolated = (1 << 9),
+    PageReferenced = (1 << 10)
+};
+
+// One per physical frame, indexed by page frame number
+struct page_t
+{
+    page_t *lru_next;
+    page_t *lru_prev;
+
+    void *owner;
+    uint64_t index;
+
+    uint32_t refcount;
+    uint32_t flags;
+
+    uint8_t order;
+    uint8_t node;
+    uint8_t zone;
+    uint8_t reserved[5];
+
+    uint64_t priv;
+    uint64_t reserved2;
+};
+static_assert(sizeof(page_t) == 64);
+
+enum allocflags
+{
+    AllocNone = 0,
+    AllocNoZero = (1 << 0)
+};
+
+struct magazine_t
+{
+    size_t count;
+    void *pages[magazine_size];
+
+    size_t alloc_hits;
+    size_t alloc_misses;
+    size_t free_hits;
+    size_t free_misses;
+};
+
+// Called without pmm_lock held when an allocation fails, returns the number of pages freed
+using reclaim_hook_t = size_t (*)();
+
 extern bool initialised;
 
-void *alloc(size_t count = 1);
+void *alloc(size_t count = 1, int flags = AllocNone);
+
+template<typename type = void*>
+type alloc(size_t count = 1, int flags = AllocNone)
+{
+    return reinterpret_cast<type>(alloc(count, flags));
+}
+
+// Returns nullptr if no free block satisfies the constraints
+void *alloc_constrained(size_t count, uint64_t max_addr, size_t align = 0x1000, size_t boundary = 0, int flags = AllocNone);
 
 template<typename type = void*>
-type alloc(size_t count = 1)
+type alloc_constrained(size_t count, uint64_t max_addr, size_t align = 0x1000, size_t boundary = 0, int flags = AllocNone)
 {
-    return reinterpret_cast<type>(alloc(count));
+    return reinterpret_cast<type>(alloc_constrained(count, max_addr, align, boundary, flags));
 }
 
+// size is huge_2m_size or huge_1g_size, returns nullptr if no such frame is free
+void *alloc_huge(size_t size, int flags = AllocNone);
+void free_huge(void *ptr, size_t size);
+size_t hugereserved(size_t size);
+
+page_t *phys2page(uint64_t phys);
+uint64_t page2phys(page_t *page);
+
+void ref(void *ptr);
+void unref(void *ptr);
+
 void *realloc(void *ptr, size_t oldcount = 1, size_t newcount = 1);
 void free(void *ptr, size_t count = 1);
 
 size_t freemem();
 size_t usedmem();
+size_t freeblocks(size_t order);
+size_t zeroedpages();
+
+void refill_zeroed();
+void add_reclaim_hook(reclaim_hook_t hook);
 
 void init();
 }
\ No newline at end of file
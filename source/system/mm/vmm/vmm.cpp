@@ -3,32 +3,383 @@
 #include <drivers/display/framebuffer/framebuffer.hpp>
 #include <drivers/display/terminal/terminal.hpp>
 #include <system/sched/scheduler/scheduler.hpp>
+#include <system/cpu/apic/apic.hpp>
+#include <system/cpu/idt/idt.hpp>
+#include <system/cpu/smp/smp.hpp>
 #include <system/mm/pmm/pmm.hpp>
 #include <system/mm/vmm/vmm.hpp>
 #include <kernel/kernel.hpp>
+#include <lib/string.hpp>
 #include <lib/memory.hpp>
 #include <lib/math.hpp>
+#include <lib/slab.hpp>
 #include <lib/cpu.hpp>
 #include <lib/log.hpp>
+#include <cpuid.h>
 
 using namespace kernel::drivers::display;
+using namespace kernel::system::cpu;
 
 namespace kernel::system::mm::vmm {
 
 bool initialised = false;
 bool lvl5 = LVL5_PAGING;
+size_t fault_around = default_fault_around;
+static bool gbpages = false;
+static size_t table_pages = 0;
+
+// Bumped whenever a range is removed from any pagemap, invalidating per-thread range caches
+static uint64_t ranges_gen = 1;
+
+static constexpr uint64_t addr_mask = 0x000FFFFFFFFFF000;
+
+new_cache(local_cache, mmap_range_local);
+new_cache(global_cache, mmap_range_global);
+
 Pagemap *kernel_pagemap = nullptr;
 
-void mmap_range_global::map_in_range(uint64_t vaddr, uint64_t paddr, int prot)
+static inline size_t toplevel()
+{
+    return lvl5 ? 4 : 3;
+}
+
+// Level 0 entries map 4 KiB, level 1 2 MiB and level 2 1 GiB
+static inline uint64_t level_size(size_t level)
+{
+    return page_size << (level * 9);
+}
+
+static inline size_t level_index(uint64_t vaddr, size_t level)
+{
+    return (vaddr >> (12 + level * 9)) & 0x1FF;
+}
+
+static size_t leaf_level(uint64_t vaddr, uint64_t paddr, uint64_t size)
+{
+    if (gbpages && size >= huge_page_size && ((vaddr | paddr) & (huge_page_size - 1)) == 0) return 2;
+    if (size >= large_page_size && ((vaddr | paddr) & (large_page_size - 1)) == 0) return 1;
+    return 0;
+}
+
+// Replaces a large page with a table of next level pages mapping the same memory
+static PTable *split_large(PDEntry *entry, size_t level)
+{
+    PTable *table = pmm::alloc<PTable*>(1, pmm::AllocNoZero);
+    __atomic_add_fetch(&table_pages, 1, __ATOMIC_RELAXED);
+
+    uint64_t paddr = entry->value & addr_mask & ~(level_size(level) - 1);
+    uint64_t flags = entry->value & ~addr_mask;
+    if (level == 1) flags &= ~LargerPages;
+
+    for (size_t i = 0; i < 512; i++) table->entries[i].value = (paddr + i * level_size(level - 1)) | flags;
+
+    entry->value = 0;
+    entry->setAddr(reinterpret_cast<uint64_t>(table) >> 12);
+    entry->setflags(Present | ReadWrite | UserSuper, true);
+    return table;
+}
+
+// Gives the pagemap its own copy of a shared table, whose child tables stay shared until written through
+static PTable *unshare(PDEntry *entry, PTable *shared, size_t level)
+{
+    PTable *table = pmm::alloc<PTable*>(1, pmm::AllocNoZero);
+    __atomic_add_fetch(&table_pages, 1, __ATOMIC_RELAXED);
+
+    for (size_t i = 0; i < 512; i++)
+    {
+        table->entries[i] = shared->entries[i];
+        if (level > 1 && table->entries[i].getflag(Present) && !table->entries[i].getflag(LargerPages)) table->entries[i].setflag(SharedTable, true);
+    }
+
+    entry->setAddr(reinterpret_cast<uint64_t>(table) >> 12);
+    entry->setflag(SharedTable, false);
+    return table;
+}
+
+// Frees the tables below table, but neither the table itself nor the memory they map
+static void free_tables(PTable *table, size_t level)
+{
+    if (level == 0) return;
+    for (size_t i = 0; i < 512; i++)
+    {
+        PDEntry &entry = table->entries[i];
+        if (!entry.getflag(Present) || entry.getflag(LargerPages) || entry.getflag(SharedTable)) continue;
+
+        PTable *child = reinterpret_cast<PTable*>(static_cast<uint64_t>(entry.getAddr()) << 12);
+        free_tables(child, level - 1);
+        pmm::free(child);
+        __atomic_sub_fetch(&table_pages, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// level is the level of curr_lvl's entries. Walks that allocate may change what they
+// reach, so they also split large pages and unshare tables on the way
+static PTable *get_next_lvl(PTable *curr_lvl, size_t entry, size_t level, bool allocate = true)
+{
+    PTable *ret = nullptr;
+    if (curr_lvl->entries[entry].getflag(Present) && curr_lvl->entries[entry].getflag(LargerPages))
+    {
+        if (allocate == true) ret = split_large(&curr_lvl->entries[entry], level);
+    }
+    else if (curr_lvl->entries[entry].getflag(Present))
+    {
+        ret = reinterpret_cast<PTable*>(static_cast<uint64_t>(curr_lvl->entries[entry].getAddr()) << 12);
+        if (allocate == true && curr_lvl->entries[entry].getflag(SharedTable)) ret = unshare(&curr_lvl->entries[entry], ret, level);
+    }
+    else if (allocate == true)
+    {
+        ret = pmm::alloc<PTable*>();
+        __atomic_add_fetch(&table_pages, 1, __ATOMIC_RELAXED);
+        curr_lvl->entries[entry].setAddr(reinterpret_cast<uint64_t>(ret) >> 12);
+        curr_lvl->entries[entry].setflags(Present | ReadWrite | UserSuper, true);
+    }
+    return ret;
+}
+
+// Remembers the tables of the last walk, so range operations
+// walk each level once per covered table instead of once per page
+struct walker_t
+{
+    Pagemap *pagemap;
+    PTable *tables[4] { };
+    uint64_t tags[4] { };
+    // Reached by an allocating walk, so never a shared table
+    bool owned[4] { };
+
+    walker_t(Pagemap *pagemap) : pagemap(pagemap) { }
+
+    // Table holding the level entries for vaddr, only tables returned with allocate set may be written to
+    PTable *table(uint64_t vaddr, size_t level, bool allocate)
+    {
+        if (level == toplevel()) return this->pagemap->TOPLVL;
+
+        uint64_t tag = vaddr >> (12 + (level + 1) * 9);
+        if (this->tables[level] != nullptr && this->tags[level] == tag && (!allocate || this->owned[level])) return this->tables[level];
+
+        PTable *parent = this->table(vaddr, level + 1, allocate);
+        if (parent == nullptr) return nullptr;
+
+        PTable *ret = get_next_lvl(parent, level_index(vaddr, level + 1), level + 1, allocate);
+        if (ret == nullptr) return nullptr;
+
+        this->tables[level] = ret;
+        this->tags[level] = tag;
+        this->owned[level] = allocate;
+        return ret;
+    }
+
+    // Returns the leaf or the empty entry covering vaddr and sets level to its level
+    PDEntry *lookup(uint64_t vaddr, size_t &level)
+    {
+        for (level = toplevel(); ; level--)
+        {
+            PDEntry *entry = &this->table(vaddr, level, false)->entries[level_index(vaddr, level)];
+            if (level == 0 || !entry->getflag(Present) || entry->getflag(LargerPages)) return entry;
+        }
+    }
+};
+
+// One shootdown at a time. Each target CPU has its flag set, flushes the range
+// if it still has the pagemap loaded and clears the flag to acknowledge
+new_lock(shootdown_lock);
+static uint8_t shootdown_vector = 0;
+static PTable *shootdown_toplvl = nullptr;
+static uint64_t shootdown_vaddr = 0;
+static uint64_t shootdown_size = 0;
+
+static void flush_range(uint64_t vaddr, uint64_t size)
+{
+    if (size > shootdown_max_pages * page_size) write_cr(3, read_cr(3));
+    else for (uint64_t i = 0; i < size; i += page_size) invlpg(vaddr + i);
+}
+
+static void shootdown_poll()
+{
+    if (!smp::initialised || !__atomic_load_n(&this_cpu->shootdown, __ATOMIC_ACQUIRE)) return;
+
+    if (getPagemap() == shootdown_toplvl) flush_range(shootdown_vaddr, shootdown_size);
+    __atomic_store_n(&this_cpu->shootdown, false, __ATOMIC_RELEASE);
+}
+
+static void shootdown_handler(registers_t *)
+{
+    shootdown_poll();
+}
+
+// lockit for the page fault path, which runs with interrupts disabled. Whoever holds
+// the lock may be waiting for this CPU to answer a shootdown, so answer it while spinning
+class faultlock
+{
+    private:
+    lock_t *lock;
+    public:
+    faultlock(lock_t &lock)
+    {
+        this->lock = &lock;
+        while (!lock.trylock())
+        {
+            shootdown_poll();
+            asm volatile ("pause");
+        }
+    }
+    ~faultlock()
+    {
+        this->lock->unlock();
+    }
+};
+
+// unmapMemRange for callers that already hold the pagemap's lock
+static void unmap_range(Pagemap *pagemap, uint64_t vaddr, uint64_t size)
+{
+    walker_t walker(pagemap);
+
+    vaddr = ALIGN_DOWN(vaddr, page_size);
+    uint64_t end = vaddr + ALIGN_UP(size, page_size);
+
+    while (vaddr < end)
+    {
+        size_t level = 0;
+        PDEntry *pml_entry = walker.lookup(vaddr, level);
+        uint64_t next = ALIGN_DOWN(vaddr, level_size(level)) + level_size(level);
+
+        if (pml_entry->getflag(Present))
+        {
+            if ((vaddr & (level_size(level) - 1)) || next > end)
+            {
+                walker.table(vaddr, level - 1, true);
+                continue;
+            }
+            pml_entry = &walker.table(vaddr, level, true)->entries[level_index(vaddr, level)];
+            pml_entry->value = 0;
+            invlpg(vaddr);
+        }
+
+        if (next < vaddr) break;
+        vaddr = next;
+    }
+}
+
+// The shadow pagemap holds the global's reference to each of its frames,
+// drops the ones in [start, end) that none of the global's locals maps anymore
+static void release_span(mmap_range_global *global, uint64_t start, uint64_t end)
+{
+    lockit(global->shadow_pagemap.lock);
+    walker_t walker(&global->shadow_pagemap);
+
+    for (uint64_t vaddr = start; vaddr < end; vaddr += page_size)
+    {
+        bool mapped = false;
+        for (auto local : global->locals)
+        {
+            if (vaddr < local->base || vaddr >= local->base + local->length) continue;
+            mapped = true;
+            break;
+        }
+        if (mapped) continue;
+
+        size_t level = 0;
+        PDEntry *shadow_entry = walker.lookup(vaddr, level);
+        if (level != 0 || !shadow_entry->getflag(Present)) continue;
+
+        pmm::unref(reinterpret_cast<void*>(static_cast<uint64_t>(shadow_entry->getAddr()) << 12));
+        shadow_entry->value = 0;
+    }
+}
+
+// munmap for callers that already hold the pagemap's lock
+static void munmap_range(Pagemap *pagemap, uint64_t address, uint64_t length)
+{
+    for (uint64_t i = address; i < address + length;)
+    {
+        auto local = pagemap->addr2range(i).local;
+        if (local == nullptr)
+        {
+            i += page_size;
+            continue;
+        }
+
+        auto global = local->global;
+        uint64_t snip_begin = i;
+        uint64_t snip_end = local->base + local->length;
+        if (snip_end > address + length) snip_end = address + length;
+        uint64_t snip_size = snip_end - snip_begin;
+        i = snip_end;
+
+        if (snip_begin > local->base && snip_end < local->base + local->length)
+        {
+            auto range = new mmap_range_local
+            {
+                .pagemap = local->pagemap,
+                .global = local->global,
+                .base = snip_end,
+                .length = (local->base + local->length) - snip_end,
+                .offset = local->offset + static_cast<int64_t>(snip_end - local->base),
+                .prot = local->prot,
+                .flags = local->flags,
+            };
+            pagemap->ranges.insert(range);
+            local->length -= range->length;
+
+            lockit(global->shadow_pagemap.lock);
+            global->locals.push_back(range);
+        }
+
+        unmap_range(pagemap, snip_begin, snip_size);
+        // Other threads of the process must stop using the frames before they can be freed
+        pagemap->shootdown(snip_begin, snip_size);
+
+        // release_span looks at the other locals of the global under its lock
+        global->shadow_pagemap.lock.lock();
+        bool whole = (snip_size == local->length);
+        if (whole)
+        {
+            pagemap->ranges.remove(local);
+            __atomic_add_fetch(&ranges_gen, 1, __ATOMIC_ACQ_REL);
+            global->locals.remove(global->locals.find(local));
+        }
+        else
+        {
+            if (snip_begin == local->base)
+            {
+                local->offset += snip_size;
+                local->base = snip_end;
+            }
+            local->length -= snip_size;
+        }
+        global->shadow_pagemap.lock.unlock();
+
+        // Page cache frames carry a reference for the mapping just like anonymous ones
+        if ((local->flags & MapAnon) || (global->res != nullptr && global->res->cached))
+        {
+            if (global->locals.empty()) release_span(global, global->base, global->base + global->length);
+            else release_span(global, snip_begin, snip_end);
+        }
+        // else global->res->munmap(i);
+
+        if (whole) delete local;
+        if (global->locals.empty())
+        {
+            free_tables(global->shadow_pagemap.TOPLVL, toplevel());
+            pmm::free(global->shadow_pagemap.TOPLVL);
+            delete global;
+        }
+    }
+}
+
+static size_t populate(Pagemap *pagemap, mmap_range_local *local, uint64_t start, uint64_t end, bool create);
+
+void mmap_range_global::map_in_range(uint64_t vaddr, uint64_t paddr, int prot, uint64_t length)
 {
     uint64_t flags = Present | UserSuper;
     if (prot & ProtWrite) flags |= ReadWrite;
-    this->shadow_pagemap.mapMem(vaddr, paddr, flags);
+    this->shadow_pagemap.mapMemRange(vaddr, paddr, length, flags, false);
 
     for (auto local : this->locals)
     {
-        if (vaddr < local->base || vaddr >= local->base + local->length) continue;
-        local->pagemap->mapMem(vaddr, paddr, flags);
+        uint64_t start = (vaddr > local->base) ? vaddr : local->base;
+        uint64_t end = (vaddr + length < local->base + local->length) ? vaddr + length : local->base + local->length;
+        if (start >= end) continue;
+        local->pagemap->mapMemRange(start, paddr + (start - vaddr), end - start, flags, false);
     }
 }
 
@@ -59,13 +410,10 @@ void Pagemap::mapRange(uint64_t vaddr, uint64_t paddr, uint64_t length, int prot
     global->shadow_pagemap.TOPLVL = pmm::alloc<PTable*>();
 
     this->lock.lock();
-    this->ranges.push_back(local);
+    this->ranges.insert(local);
     this->lock.unlock();
 
-    for (size_t i = 0; i < length; i += page_size)
-    {
-        global->map_in_range(vaddr + i, paddr + i, prot);
-    }
+    global->map_in_range(vaddr, paddr, prot, length);
 }
 
 void *Pagemap::mmap(void *addr, uint64_t length, int prot, int flags, vfs::resource_t *res, int64_t offset)
@@ -84,11 +432,7 @@ void *Pagemap::mmap(void *addr, uint64_t length, int prot, int flags, vfs::resou
     length = ALIGN_UP(length, page_size);
 
     uint64_t base = 0;
-    if (flags & MapFixed)
-    {
-        base = reinterpret_cast<uint64_t>(addr);
-        this->munmap(addr, length);
-    }
+    if (flags & MapFixed) base = reinterpret_cast<uint64_t>(addr);
     else
     {
         base = this_proc()->mmap_anon_base;
@@ -118,7 +462,16 @@ void *Pagemap::mmap(void *addr, uint64_t length, int prot, int flags, vfs::resou
     global->shadow_pagemap.TOPLVL = static_cast<PTable*>(pmm::alloc());
 
     this->lock.lock();
-    this->ranges.push_back(local);
+    if (flags & MapFixed) munmap_range(this, base, length);
+
+    // The identity map may cover the range, its pages must fault in instead
+    unmap_range(this, base, length);
+    this->ranges.insert(local);
+    if (flags & MapPopulate)
+    {
+        lockit(global->shadow_pagemap.lock);
+        populate(this, local, base, base + length, true);
+    }
     this->lock.unlock();
 
     if (res != nullptr) res->refcount++;
@@ -134,88 +487,120 @@ bool Pagemap::munmap(void *addr, uint64_t length)
     }
     length = ALIGN_UP(length, page_size);
 
-    uint64_t address = reinterpret_cast<uint64_t>(addr);
-    for (uint64_t i = address; i < address + length; i += page_size)
-    {
-        auto local = this->addr2range(i).local;
-        if (local == nullptr) continue;
+    lockit(this->lock);
+    munmap_range(this, reinterpret_cast<uint64_t>(addr), length);
+    return true;
+}
 
-        auto global = local->global;
-        uint64_t snip_begin = i;
-        while (true)
+// Moves an anonymous page to newphys in every pagemap that maps it.
+// Fails instead of waiting if one of them is busy, the caller holds pmm_lock
+bool migrate_page(pmm::page_t *page, uint64_t newphys)
+{
+    auto global = static_cast<mmap_range_global*>(page->owner);
+    uint64_t vaddr = page->index;
+    uint64_t oldphys = pmm::page2phys(page);
+
+    // Runs under pmm_lock, which other CPUs spin on with interrupts disabled,
+    // so nothing here may wait for a lock or for another CPU.
+    // locals only changes under the shadow pagemap's lock
+    if (!global->shadow_pagemap.lock.trylock()) return false;
+
+    // A range split by munmap leaves several locals of the global in one pagemap
+    auto first = [&](size_t i)
+    {
+        for (size_t j = 0; j < i; j++)
         {
-            i += page_size;
-            if (i >= local->base + local->length || i >= address + length) break;
+            if (global->locals[j]->pagemap == global->locals[i]->pagemap) return false;
         }
-        uint64_t snip_end = i;
-        uint64_t snip_size = snip_end - snip_begin;
+        return true;
+    };
 
-        if (snip_begin > local->base && snip_end < local->base + local->length)
+    size_t locked = 0;
+    for (; locked < global->locals.size(); locked++)
+    {
+        if (first(locked) && !global->locals[locked]->pagemap->lock.trylock()) break;
+    }
+
+    bool ret = (locked == global->locals.size());
+    if (ret)
+    {
+        // Nothing may be allocated under pmm_lock, so walk the entries again instead of collecting them
+        auto for_each_entry = [&](bool present, auto func)
         {
-            auto range = new mmap_range_local
+            auto update = [&](Pagemap *pagemap)
             {
-                .pagemap = local->pagemap,
-                .global = local->global,
-                .base = snip_end,
-                .length = (local->base + local->length) - snip_end,
-                .offset = local->offset + static_cast<int64_t>(snip_end - local->base),
-                .prot = local->prot,
-                .flags = local->flags,
+                PDEntry *pml_entry = pagemap->virt2pte(vaddr, false);
+                if (pml_entry == nullptr || pml_entry->getflag(Present) != present || pml_entry->getAddr() != oldphys >> 12) return;
+                func(pml_entry);
             };
-            this->ranges.push_back(range);
-            local->length -= range->length;
-        }
+            update(&global->shadow_pagemap);
+            for (size_t i = 0; i < global->locals.size(); i++)
+            {
+                if (first(i)) update(global->locals[i]->pagemap);
+            }
+        };
+
+        // Unmap the page first, a CPU that loads one of the pagemaps from now on can't cache it
+        for_each_entry(true, [](PDEntry *pml_entry) { pml_entry->setflag(Present, false); });
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        invlpg(vaddr);
 
-        for (size_t p = 0; p < snip_end; p += page_size) this->unmapMem(p);
-        if (snip_size == local->length) this->ranges.remove(local);
-        if (snip_size == local->length && global->locals.size() == 1)
+        // If any of them is still running elsewhere its TLB may hold the old frame
+        // writable, skip the page rather than wait for a shootdown under pmm_lock
+        if (smp::initialised)
         {
-            if (local->flags & MapAnon)
+            size_t self = this_cpu->id;
+            for (size_t i = 0; i < smp_request.response->cpu_count && ret; i++)
             {
-                for (size_t p = global->base; p < global->base + global->length; p += page_size)
+                auto proc = smp::cpus[i].current_proc;
+                if (i == self || proc == nullptr) continue;
+
+                for (auto local : global->locals)
                 {
-                    uint64_t paddr = global->shadow_pagemap.virt2phys(p);
-                    if (!global->shadow_pagemap.unmapMem(p))
-                    {
-                        errno_set(EINVAL);
-                        return false;
-                    }
-                    pmm::free(reinterpret_cast<void*>(paddr));
+                    if (proc->pagemap != local->pagemap) continue;
+                    ret = false;
+                    break;
                 }
             }
-            // else global->res->munmap(i);
-            delete local;
         }
-        else
+
+        if (ret) memcpy(reinterpret_cast<void*>(newphys + hhdm_offset), reinterpret_cast<void*>(oldphys + hhdm_offset), page_size);
+        for_each_entry(false, [&](PDEntry *pml_entry)
         {
-            if (snip_begin == local->base)
-            {
-                local->offset += snip_size;
-                local->base = snip_end;
-            }
-            local->length -= snip_size;
-        }
+            if (ret) pml_entry->setAddr(newphys >> 12);
+            pml_entry->setflag(Present, true);
+        });
     }
 
-    return true;
+    for (size_t i = 0; i < locked; i++)
+    {
+        if (first(i)) global->locals[i]->pagemap->lock.unlock();
+    }
+    global->shadow_pagemap.lock.unlock();
+    return ret;
 }
 
 Pagemap *Pagemap::fork()
 {
     lockit(this->lock);
     Pagemap *newpagemap = newPagemap();
+    bool flush = false;
 
-    for (auto local : this->ranges)
+    for (auto local = this->ranges.first(); local != nullptr; local = this->ranges.next(local))
     {
         auto global = local->global;
         auto newlocal = new mmap_range_local;
         *newlocal = *local;
+        newlocal->pagemap = newpagemap;
+        newpagemap->unmapMemRange(local->base, local->length);
 
         if (global->res) global->res->refcount++;
         if (local->flags & MapShared)
         {
             newlocal->global = global;
+            global->shadow_pagemap.lock.lock();
             global->locals.push_back(newlocal);
+            global->shadow_pagemap.lock.unlock();
             for (size_t i = local->base; i < local->base + local->length; i += page_size)
             {
                 auto oldpml = this->virt2pte(i, false);
@@ -237,56 +622,255 @@ Pagemap *Pagemap::fork()
             newglobal->locals.push_back(newlocal);
             newglobal->shadow_pagemap.TOPLVL = pmm::alloc<PTable*>();
 
+            // Both sides share the frames read only until one of them writes
             if (local->flags & MapAnon)
             {
+                walker_t oldwalker(this);
+                walker_t newwalker(newpagemap);
+                walker_t shadowwalker(&newglobal->shadow_pagemap);
+
                 for (size_t i = local->base; i < local->base + local->length; i += page_size)
                 {
-                    auto oldpml = this->virt2pte(i, false);
-                    if (oldpml == nullptr || !oldpml->getflag(Present)) continue;
+                    size_t level = 0;
+                    PDEntry *oldpml = oldwalker.lookup(i, level);
+                    if (level != 0 || !oldpml->getflag(Present)) continue;
 
-                    auto newpml = newpagemap->virt2pte(i, true);
-                    if (newpml == nullptr) return nullptr;
+                    if (oldpml->getflag(ReadWrite))
+                    {
+                        oldpml->setflag(ReadWrite, false);
+                        oldpml->setflag(CopyOnWrite, true);
+                    }
 
-                    auto newshadowpml = newglobal->shadow_pagemap.virt2pte(i, true);
-                    if (newpml == nullptr) return nullptr;
+                    pmm::page_t *desc = pmm::phys2page(oldpml->getAddr() << 12);
+                    desc->flags |= pmm::PageCOW;
+                    __atomic_add_fetch(&desc->refcount, 1, __ATOMIC_ACQ_REL);
 
-                    void *page = pmm::alloc();
-                    memcpy(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(page) + hhdm_offset), reinterpret_cast<void*>((oldpml->getAddr() << 12) + hhdm_offset), page_size);
-                    newpml->value = (oldpml->value & 0xFFFUL) | reinterpret_cast<uint64_t>(page);
-                    newshadowpml->value = newpml->value;
+                    newwalker.table(i, 0, true)->entries[level_index(i, 0)].value = oldpml->value;
+                    shadowwalker.table(i, 0, true)->entries[level_index(i, 0)].value = oldpml->value;
                 }
+                flush = true;
             }
             else panic("Non-anonymous fork!");
         }
-        newpagemap->ranges.push_back(newlocal);
+        newpagemap->ranges.insert(newlocal);
     }
+
+    // Threads of this process on other CPUs may still have the pages cached as writable
+    if (flush) this->shootdown(0, UINT64_MAX);
     return newpagemap;
 }
 
+bool Pagemap::cow_fault(uint64_t vaddr)
+{
+    faultlock guard(this->lock);
+
+    auto local = this->addr2range(vaddr).local;
+    if (local == nullptr || !(local->prot & ProtWrite)) return false;
+
+    vaddr = ALIGN_DOWN(vaddr, page_size);
+
+    PDEntry *pml_entry = this->virt2pte(vaddr, false);
+    if (pml_entry == nullptr || !pml_entry->getflag(Present)) return false;
+
+    // Another thread already resolved it
+    if (pml_entry->getflag(ReadWrite))
+    {
+        invlpg(vaddr);
+        return true;
+    }
+    if (!pml_entry->getflag(CopyOnWrite)) return false;
+
+    uint64_t paddr = pml_entry->getAddr() << 12;
+    pmm::page_t *desc = pmm::phys2page(paddr);
+
+    // Nobody else maps the frame anymore, take it over instead of copying
+    if (__atomic_load_n(&desc->refcount, __ATOMIC_ACQUIRE) == 1) desc->flags &= ~pmm::PageCOW;
+    else
+    {
+        void *page = pmm::alloc(1, pmm::AllocNoZero);
+        memcpy(reinterpret_cast<void*>(reinterpret_cast<uint64_t>(page) + hhdm_offset), reinterpret_cast<void*>(paddr + hhdm_offset), page_size);
+        pmm::unref(reinterpret_cast<void*>(paddr));
+
+        paddr = reinterpret_cast<uint64_t>(page);
+        desc = pmm::phys2page(paddr);
+        desc->flags |= pmm::PageAnon;
+    }
+    desc->owner = local->global;
+    desc->index = vaddr;
+
+    pml_entry->setAddr(paddr >> 12);
+    pml_entry->setflag(CopyOnWrite, false);
+    pml_entry->setflag(ReadWrite, true);
+    invlpg(vaddr);
+
+    PDEntry *shadow_entry = local->global->shadow_pagemap.virt2pte(vaddr, false);
+    if (shadow_entry != nullptr) shadow_entry->value = pml_entry->value;
+    return true;
+}
+
+// Maps [start, end) of local into pagemap, taking frames the range already has from its shadow pagemap.
+// Missing frames are only created if create is set. Both pagemaps' locks must be held
+static size_t populate(Pagemap *pagemap, mmap_range_local *local, uint64_t start, uint64_t end, bool create)
+{
+    auto global = local->global;
+    walker_t walker(pagemap);
+    walker_t shadow_walker(&global->shadow_pagemap);
+
+    uint64_t flags = Present | UserSuper;
+    if (local->prot & ProtWrite) flags |= ReadWrite;
+
+    size_t mapped = 0;
+    for (uint64_t vaddr = start; vaddr < end; vaddr += page_size)
+    {
+        PDEntry *pml_entry = &walker.table(vaddr, 0, true)->entries[level_index(vaddr, 0)];
+        if (pml_entry->getflag(Present)) continue;
+
+        PDEntry *shadow_entry = &shadow_walker.table(vaddr, 0, true)->entries[level_index(vaddr, 0)];
+        if (!shadow_entry->getflag(Present))
+        {
+            if (create == false) continue;
+
+            void *page = nullptr;
+            if (local->flags & MapAnon)
+            {
+                page = pmm::alloc();
+
+                pmm::page_t *desc = pmm::phys2page(reinterpret_cast<uint64_t>(page));
+                desc->flags |= pmm::PageAnon;
+                desc->owner = global;
+                desc->index = vaddr;
+            }
+            else page = global->res->mmap(local->offset / page_size + (vaddr - local->base) / page_size, local->flags);
+            if (page == nullptr) break;
+
+            shadow_entry->value = 0;
+            shadow_entry->setAddr(reinterpret_cast<uint64_t>(page) >> 12);
+            shadow_entry->setflags(flags, true);
+        }
+
+        pml_entry->value = 0;
+        pml_entry->setAddr(shadow_entry->getAddr());
+        pml_entry->setflags(flags, true);
+        mapped++;
+    }
+    return mapped;
+}
+
+fault_type Pagemap::fault(uint64_t vaddr, uint64_t error_code)
+{
+    // Write to a present page
+    if ((error_code & 0x03) == 0x03) return this->cow_fault(vaddr) ? FaultCOW : FaultNone;
+    if (error_code & 0x01) return FaultNone;
+
+    faultlock guard(this->lock);
+
+    auto [local, mem_page, file_page] = this->addr2range(vaddr);
+    if (local == nullptr) return FaultNone;
+    if ((error_code & 0x02) && !(local->prot & ProtWrite)) return FaultNone;
+
+    vaddr = mem_page * page_size;
+    PDEntry *pml_entry = this->virt2pte(vaddr, true);
+    if (pml_entry == nullptr) return FaultNone;
+
+    // Another thread already resolved it
+    if (pml_entry->getflag(Present)) return FaultMinor;
+
+    // The shadow pagemap holds the frames of the range, other pagemaps sharing it may have faulted them in already
+    auto global = local->global;
+    lockit(global->shadow_pagemap.lock);
+
+    PDEntry *shadow_entry = global->shadow_pagemap.virt2pte(vaddr, true);
+    if (shadow_entry == nullptr) return FaultNone;
+
+    uint64_t flags = Present | UserSuper;
+    if (local->prot & ProtWrite) flags |= ReadWrite;
+
+    fault_type ret = FaultMinor;
+    if (!shadow_entry->getflag(Present))
+    {
+        void *page = nullptr;
+        if (local->flags & MapAnon)
+        {
+            page = pmm::alloc();
+
+            pmm::page_t *desc = pmm::phys2page(reinterpret_cast<uint64_t>(page));
+            desc->flags |= pmm::PageAnon;
+            desc->owner = global;
+            desc->index = vaddr;
+        }
+        else
+        {
+            page = global->res->mmap(file_page, local->flags);
+            ret = FaultMajor;
+        }
+        if (page == nullptr) return FaultNone;
+
+        shadow_entry->value = 0;
+        shadow_entry->setAddr(reinterpret_cast<uint64_t>(page) >> 12);
+        shadow_entry->setflags(flags, true);
+    }
+
+    pml_entry->value = 0;
+    pml_entry->setAddr(shadow_entry->getAddr());
+    pml_entry->setflags(flags, true);
+
+    // Neighbours the range already has frames for, anonymous ones are cheap enough to allocate
+    if (fault_around > 1)
+    {
+        uint64_t window = fault_around * page_size;
+        uint64_t start = ALIGN_DOWN(vaddr, window);
+        uint64_t end = start + window;
+        if (start < local->base) start = local->base;
+        if (end > local->base + local->length) end = local->base + local->length;
+
+        populate(this, local, start, end, local->flags & MapAnon);
+    }
+    return ret;
+}
+
 void Pagemap::deleteThis()
 {
-    lockit(this->lock);
-    for (auto range : this->ranges)
+    // munmap would take the lock again, and a lockit guard would unlock it after the delete
+    this->lock.lock();
+    for (auto range = this->ranges.first(); range != nullptr;)
     {
-        this->munmap(reinterpret_cast<void*>(range->base), range->length);
+        auto next = this->ranges.next(range);
+        munmap_range(this, range->base, range->length);
+        range = next;
     }
+    this->lock.unlock();
     delete this;
 }
 
-PTable *get_next_lvl(PTable *curr_lvl, size_t entry, bool allocate = true)
+mmap_range_local *Pagemap::find_range(uint64_t addr)
 {
-    PTable *ret = nullptr;
-    if (curr_lvl->entries[entry].getflag(Present))
+    bool ints = interrupts_enabled();
+    asm volatile ("cli");
+
+    scheduler::thread_t *thread = smp::initialised ? this_cpu->current_thread : nullptr;
+    uint64_t gen = __atomic_load_n(&ranges_gen, __ATOMIC_ACQUIRE);
+
+    mmap_range_local *range = nullptr;
+    if (thread != nullptr && thread->last_range_gen == gen && thread->last_range->pagemap == this)
     {
-        ret = reinterpret_cast<PTable*>(static_cast<uint64_t>(curr_lvl->entries[entry].getAddr()) << 12);
+        range = thread->last_range;
+        if (addr < range->base || addr >= range->base + range->length) range = nullptr;
     }
-    else if (allocate == true)
+
+    if (range == nullptr)
     {
-        ret = pmm::alloc<PTable*>();
-        curr_lvl->entries[entry].setAddr(reinterpret_cast<uint64_t>(ret) >> 12);
-        curr_lvl->entries[entry].setflags(Present | ReadWrite | UserSuper, true);
+        range = this->ranges.floor(addr);
+        if (range != nullptr && addr >= range->base + range->length) range = nullptr;
+
+        if (range != nullptr && thread != nullptr)
+        {
+            thread->last_range = range;
+            thread->last_range_gen = gen;
+        }
     }
-    return ret;
+
+    if (ints) asm volatile ("sti");
+    return range;
 }
 
 PDEntry *Pagemap::virt2pte(uint64_t vaddr, bool allocate, bool hugepages)
@@ -304,7 +888,7 @@ PDEntry *Pagemap::virt2pte(uint64_t vaddr, bool allocate, bool hugepages)
         pml5 = this->TOPLVL;
         if (pml5 == nullptr) return nullptr;
 
-        pml4 = get_next_lvl(pml5, pml5_entry, allocate);
+        pml4 = get_next_lvl(pml5, pml5_entry, 4, allocate);
     }
     else
     {
@@ -313,19 +897,33 @@ PDEntry *Pagemap::virt2pte(uint64_t vaddr, bool allocate, bool hugepages)
     }
     if (pml4 == nullptr) return nullptr;
 
-    pml3 = get_next_lvl(pml4, pml4_entry, allocate);
+    pml3 = get_next_lvl(pml4, pml4_entry, 3, allocate);
     if (pml3 == nullptr) return nullptr;
 
-    pml2 = get_next_lvl(pml3, pml3_entry, allocate);
+    pml2 = get_next_lvl(pml3, pml3_entry, 2, allocate);
     if (pml2 == nullptr) return nullptr;
     if (hugepages) return &pml2->entries[pml2_entry];
 
-    pml1 = get_next_lvl(pml2, pml2_entry, allocate);
+    pml1 = get_next_lvl(pml2, pml2_entry, 1, allocate);
     if (pml1 == nullptr) return nullptr;
 
     return &pml1->entries[pml1_entry];
 }
 
+uint64_t Pagemap::virt2phys(uint64_t vaddr)
+{
+    if (this->TOPLVL == nullptr) return 0;
+
+    walker_t walker(this);
+    size_t level = 0;
+
+    PDEntry *pml_entry = walker.lookup(vaddr, level);
+    if (!pml_entry->getflag(Present)) return 0;
+
+    uint64_t offset = level_size(level) - 1;
+    return (pml_entry->value & addr_mask & ~offset) | (vaddr & offset);
+}
+
 void Pagemap::mapMem(uint64_t vaddr, uint64_t paddr, uint64_t flags, bool hugepages)
 {
     lockit(this->lock);
@@ -343,9 +941,41 @@ void Pagemap::mapMem(uint64_t vaddr, uint64_t paddr, uint64_t flags, bool hugepa
 
 void Pagemap::mapMemRange(uint64_t vaddr, uint64_t paddr, uint64_t size, uint64_t flags, bool hugepages)
 {
-    for (size_t i = 0; i < size; i += (hugepages ? large_page_size : page_size))
+    lockit(this->lock);
+    walker_t walker(this);
+
+    vaddr = ALIGN_DOWN(vaddr, page_size);
+    paddr = ALIGN_DOWN(paddr, page_size);
+    uint64_t end = vaddr + ALIGN_UP(size, page_size);
+
+    while (vaddr < end)
     {
-        this->mapMem(vaddr + i, paddr + i, flags, hugepages);
+        size_t level = hugepages ? leaf_level(vaddr, paddr, end - vaddr) : 0;
+
+        PDEntry *pml_entry = nullptr;
+        while (true)
+        {
+            PTable *table = walker.table(vaddr, level, true);
+            if (table == nullptr)
+            {
+                error("VMM: Could not get page map entry!");
+                return;
+            }
+            pml_entry = &table->entries[level_index(vaddr, level)];
+
+            // Don't drop a table that already maps part of the range
+            if (level == 0 || !pml_entry->getflag(Present) || pml_entry->getflag(LargerPages)) break;
+            level--;
+        }
+
+        bool present = pml_entry->getflag(Present);
+        pml_entry->value = 0;
+        pml_entry->setAddr(paddr >> 12);
+        pml_entry->setflags(flags | (level ? LargerPages : 0), true);
+        if (present) invlpg(vaddr);
+
+        vaddr += level_size(level);
+        paddr += level_size(level);
     }
 }
 
@@ -386,12 +1016,95 @@ bool Pagemap::unmapMem(uint64_t vaddr, bool hugepages)
     return true;
 }
 
-void Pagemap::unmapMemRange(uint64_t vaddr, uint64_t size, bool hugepages)
+void Pagemap::unmapMemRange(uint64_t vaddr, uint64_t size)
+{
+    lockit(this->lock);
+    unmap_range(this, vaddr, size);
+}
+
+void Pagemap::protectMemRange(uint64_t vaddr, uint64_t size, uint64_t flags)
 {
-    for (size_t i = 0; i < size; i += (hugepages ? large_page_size : page_size))
+    lockit(this->lock);
+    walker_t walker(this);
+
+    vaddr = ALIGN_DOWN(vaddr, page_size);
+    uint64_t end = vaddr + ALIGN_UP(size, page_size);
+
+    while (vaddr < end)
     {
-        this->unmapMem(vaddr + i);
+        size_t level = 0;
+        PDEntry *pml_entry = walker.lookup(vaddr, level);
+        uint64_t next = ALIGN_DOWN(vaddr, level_size(level)) + level_size(level);
+
+        if (pml_entry->getflag(Present))
+        {
+            if ((vaddr & (level_size(level) - 1)) || next > end)
+            {
+                walker.table(vaddr, level - 1, true);
+                continue;
+            }
+            pml_entry = &walker.table(vaddr, level, true)->entries[level_index(vaddr, level)];
+            pml_entry->value = (pml_entry->value & addr_mask) | flags | (level ? LargerPages : 0);
+            invlpg(vaddr);
+        }
+
+        if (next < vaddr) break;
+        vaddr = next;
+    }
+}
+
+void Pagemap::shootdown(uint64_t vaddr, uint64_t size)
+{
+    bool ints = interrupts_enabled();
+    asm volatile ("cli");
+
+    if (getPagemap() == this->TOPLVL) flush_range(vaddr, size);
+    if (!smp::initialised || shootdown_vector == 0)
+    {
+        if (ints) asm volatile ("sti");
+        return;
+    }
+
+    while (!shootdown_lock.trylock())
+    {
+        shootdown_poll();
+        asm volatile ("pause");
+    }
+
+    shootdown_toplvl = this->TOPLVL;
+    shootdown_vaddr = vaddr;
+    shootdown_size = size;
+
+    // CPUs that load the pagemap after this start with an empty TLB for it anyway
+    size_t self = this_cpu->id;
+    for (size_t i = 0; i < smp_request.response->cpu_count; i++)
+    {
+        smp::cpu_t &cpu = smp::cpus[i];
+        if (i == self || cpu.current_proc == nullptr || cpu.current_proc->pagemap != this) continue;
+
+        __atomic_store_n(&cpu.shootdown, true, __ATOMIC_RELEASE);
+        apic::apic_send_ipi(cpu.lapic_id, shootdown_vector);
+    }
+
+    for (size_t i = 0; i < smp_request.response->cpu_count; i++)
+    {
+        while (__atomic_load_n(&smp::cpus[i].shootdown, __ATOMIC_ACQUIRE))
+        {
+            shootdown_poll();
+            asm volatile ("pause");
+        }
     }
+
+    shootdown_lock.unlock();
+    if (ints) asm volatile ("sti");
+}
+
+void shootdown_init()
+{
+    if (shootdown_vector != 0 || !apic::initialised) return;
+
+    shootdown_vector = idt::alloc_vector();
+    idt::register_interrupt_handler(shootdown_vector, shootdown_handler, false);
 }
 
 void Pagemap::switchTo()
@@ -404,50 +1117,73 @@ void Pagemap::save()
     this->TOPLVL = reinterpret_cast<PTable*>(read_cr(3));
 }
 
+// Lower half top level entries holding the identity map. The kernel dereferences physical
+// addresses, but user mappings live in the lower half too, so unlike the upper half these
+// tables are only shared until the pagemap writes through them
+static size_t identity_entries = 0;
+
 Pagemap *newPagemap()
 {
     Pagemap *pagemap = new Pagemap;
-    pagemap->TOPLVL = new PTable;
+    pagemap->TOPLVL = pmm::alloc<PTable*>();
 
-    if (kernel_pagemap)
+    PTable *toplvl = reinterpret_cast<PTable*>(reinterpret_cast<uint64_t>(pagemap->TOPLVL) + hhdm_offset);
+    PTable *kerneltoplvl = reinterpret_cast<PTable*>(reinterpret_cast<uint64_t>(kernel_pagemap->TOPLVL) + hhdm_offset);
+    for (size_t i = 0; i < identity_entries; i++)
     {
-
-        PTable *toplvl = reinterpret_cast<PTable*>(reinterpret_cast<uint64_t>(pagemap->TOPLVL) + hhdm_offset);
-        PTable *kerenltoplvl = reinterpret_cast<PTable*>(reinterpret_cast<uint64_t>(kernel_pagemap->TOPLVL) + hhdm_offset);
-        for (size_t i = 256; i < 512; i++) toplvl[i] = kerenltoplvl[i];
+        toplvl->entries[i] = kerneltoplvl->entries[i];
+        if (toplvl->entries[i].getflag(Present)) toplvl->entries[i].setflag(SharedTable, true);
     }
-    else for (size_t i = 256; i < 512; i++) get_next_lvl(pagemap->TOPLVL, i, true);
+    for (size_t i = 256; i < 512; i++) toplvl->entries[i] = kerneltoplvl->entries[i];
+
+    return pagemap;
+}
+
+// Built once at boot, every upper half entry is allocated up front so
+// later kernel mappings show up in all pagemaps that copied them
+static void build_kernel_pagemap()
+{
+    kernel_pagemap = new Pagemap;
+    kernel_pagemap->TOPLVL = pmm::alloc<PTable*>();
 
-    for (uint64_t i = 0; i < 0x100000000; i += large_page_size)
+    for (size_t i = 256; i < 512; i++) get_next_lvl(kernel_pagemap->TOPLVL, i, toplevel(), true);
+
+    // Identity map and HHDM of the low 4 GiB and of everything in the memory map above it.
+    // Adjacent entries are merged so 1 GiB pages aren't broken up at entry boundaries
+    auto map_direct = [](uint64_t base, uint64_t top)
     {
-        pagemap->mapMem(i, i, Present | ReadWrite | UserSuper, true);
-        pagemap->mapMem(i + hhdm_offset, i, Present | ReadWrite | UserSuper, true);
-    }
+        kernel_pagemap->mapMemRange(base, base, top - base, Present | ReadWrite | UserSuper);
+        kernel_pagemap->mapMemRange(base + hhdm_offset, base, top - base, Present | ReadWrite | UserSuper);
+    };
 
+    uint64_t span_base = 0, span_top = 0x100000000;
     for (size_t i = 0; i < memmap_request.response->entry_count; i++)
     {
         limine_memmap_entry *mmap = memmap_request.response->entries[i];
 
         uint64_t base = ALIGN_DOWN(mmap->base, page_size);
         uint64_t top = ALIGN_UP(mmap->base + mmap->length, page_size);
-        if (top < 0x100000000) continue;
+        if (top <= span_top) continue;
+        if (base < span_top) base = span_top;
 
-        for (uint64_t t = base; t < top; t += page_size)
+        if (base != span_top)
         {
-            if (t < 0x100000000) continue;
-            pagemap->mapMem(t, t, Present | ReadWrite | UserSuper);
-            pagemap->mapMem(t + hhdm_offset, t, Present | ReadWrite | UserSuper);
+            map_direct(span_base, span_top);
+            span_base = base;
         }
+        span_top = top;
     }
+    map_direct(span_base, span_top);
+    uint64_t identity_top = span_top;
 
-    for (size_t i = 0; i < kernel_file_request.response->kernel_file->size; i += page_size)
-    {
-        uint64_t paddr = kernel_address_request.response->physical_base + i;
-        uint64_t vaddr = kernel_address_request.response->virtual_base + i;
-        pagemap->mapMem(vaddr, paddr, Present | ReadWrite | UserSuper);
-    }
+    kernel_pagemap->mapMemRange(kernel_address_request.response->virtual_base, kernel_address_request.response->physical_base, kernel_file_request.response->kernel_file->size, Present | ReadWrite | UserSuper);
 
-    return pagemap;
+    identity_entries = DIV_ROUNDUP(identity_top, level_size(toplevel()));
+}
+
+size_t tablepages()
+{
+    return __atomic_load_n(&table_pages, __ATOMIC_RELAXED);
 }
 
 PTable *getPagemap()
@@ -465,9 +1201,22 @@ void init()
         return;
     }
 
-    kernel_pagemap = newPagemap();
+    uint32_t a = 0, b = 0, c = 0, d = 0;
+    if (__get_cpuid(0x80000001, &a, &b, &c, &d)) gbpages = d & CPUID_GBPAGE;
+
+    const char *arg = strstr(cmdline, "faultaround=");
+    if (arg != nullptr)
+    {
+        fault_around = strtol(arg + strlen("faultaround="), nullptr, 10);
+        if (fault_around > max_fault_around) fault_around = max_fault_around;
+        log("VMM: Fault-around of %zu pages", fault_around);
+    }
+
+    build_kernel_pagemap();
     kernel_pagemap->switchTo();
 
+    log("VMM: Direct map uses %s pages, %zu page table pages (%zu KB)", gbpages ? "1 GB" : "2 MB", tablepages(), tablepages() * 4);
+
     serial::newline();
     initialised = true;
 }
@@ -2,16 +2,24 @@
 
 #pragma once
 
+#include <system/mm/pmm/pmm.hpp>
 #include <system/vfs/vfs.hpp>
+#include <lib/rbtree.hpp>
 #include <lib/lock.hpp>
 #include <cstdint>
 #include <cstddef>
 
 namespace kernel::system::mm::vmm {
 
+static constexpr uint64_t huge_page_size = 0x40000000;
 static constexpr uint64_t large_page_size = 0x200000;
 static constexpr uint64_t page_size = 0x1000;
 
+static constexpr size_t default_fault_around = 16;
+static constexpr size_t max_fault_around = 512;
+// Shootdowns of more pages than this reload CR3 instead
+static constexpr size_t shootdown_max_pages = 32;
+
 enum PT_Flag
 {
     Present = (1 << 0),
@@ -25,6 +33,9 @@ enum PT_Flag
     Custom0 = (1 << 9),
     Custom1 = (1 << 10),
     Custom2 = (1 << 11),
+    CopyOnWrite = (1 << 9),
+    // Non-leaf entry pointing at a table the pagemap shares with the kernel's, see newPagemap
+    SharedTable = (1 << 10),
     NX = (1UL << 63)
 };
 
@@ -38,7 +49,23 @@ enum mmap_flags
     MapPrivate = 0x01,
     MapShared = 0x02,
     MapFixed = 0x04,
-    MapAnon = 0x08
+    MapAnon = 0x08,
+    MapPopulate = 0x10
+};
+
+enum fault_type
+{
+    FaultNone,
+    FaultMinor,
+    FaultMajor,
+    FaultCOW
+};
+
+struct fault_stats_t
+{
+    size_t minor;
+    size_t major;
+    size_t cow;
 };
 
 struct PDEntry
@@ -96,53 +123,63 @@ struct mmap_range_local
     int64_t offset;
     int prot;
     int flags;
+
+    rbnode node;
+
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr);
 };
 
 struct Pagemap
 {
     lock_t lock;
     PTable *TOPLVL = nullptr;
-    vector<mmap_range_local*> ranges;
 
-    PDEntry *virt2pte(uint64_t vaddr, bool allocate = true, bool hugepages = false);
-    uint64_t virt2phys(uint64_t vaddr, bool hugepages = false)
-    {
-        PDEntry *pml_entry = this->virt2pte(vaddr, false, hugepages);
-        if (pml_entry == nullptr || !pml_entry->getflag(Present)) return 0;
+    // Ranges never overlap, so ordering them by base is enough to find the one holding an address.
+    // munmap may move a base forward without reinserting, as that can't change the order
+    rbtree<mmap_range_local, &mmap_range_local::node, &mmap_range_local::base> ranges;
 
-        return pml_entry->getAddr() << 12;
-    }
+    PDEntry *virt2pte(uint64_t vaddr, bool allocate = true, bool hugepages = false);
+    uint64_t virt2phys(uint64_t vaddr);
 
     void mapMem(uint64_t vaddr, uint64_t paddr, uint64_t flags = (Present | ReadWrite), bool hugepages = false);
-    void mapMemRange(uint64_t vaddr, uint64_t paddr, uint64_t size, uint64_t flags = (Present | ReadWrite), bool hugepages = false);
+    // Takes the lock once and walks each table once, uses 2 MiB and 1 GiB pages where alignment allows unless hugepages is false
+    void mapMemRange(uint64_t vaddr, uint64_t paddr, uint64_t size, uint64_t flags = (Present | ReadWrite), bool hugepages = true);
 
     bool remapMem(uint64_t vaddr_old, uint64_t vaddr_new, uint64_t flags = (Present | ReadWrite));
 
     bool unmapMem(uint64_t vaddr, bool hugepages = false);
-    void unmapMemRange(uint64_t vaddr, uint64_t pagecount, bool hugepages = false);
+    // Large pages that are only partly covered by the range are split first
+    void unmapMemRange(uint64_t vaddr, uint64_t size);
+    void protectMemRange(uint64_t vaddr, uint64_t size, uint64_t flags);
+
+    // Checks the calling thread's last hit before searching the tree
+    mmap_range_local *find_range(uint64_t addr);
 
     auto addr2range(uint64_t addr)
     {
         struct ret { mmap_range_local *local; uint64_t mem_page; uint64_t file_page; };
 
-        for (auto range : this->ranges)
-        {
-            if (addr >= range->base && addr < range->base + range->length)
-            {
-                uint64_t mem_page = addr / page_size;
-                uint64_t file_page = range->offset / page_size + (mem_page - range->base / page_size);
-                return ret { range, mem_page, file_page };
-            }
-        }
-
-        return ret { nullptr, 0, 0 };
+        auto range = this->find_range(addr);
+        if (range == nullptr) return ret { nullptr, 0, 0 };
+
+        uint64_t mem_page = addr / page_size;
+        uint64_t file_page = range->offset / page_size + (mem_page - range->base / page_size);
+        return ret { range, mem_page, file_page };
     }
 
     void mapRange(uint64_t vaddr, uint64_t paddr, uint64_t length, int prot, int flags);
     void *mmap(void *addr, uint64_t length, int prot, int flags, vfs::resource_t *res, int64_t offset);
     bool munmap(void *addr, uint64_t length);
 
+    // Private anonymous memory is shared copy on write
     Pagemap *fork();
+    // Resolves a write to a copy on write page, false if the fault wasn't one
+    bool cow_fault(uint64_t vaddr);
+    // Takes only this pagemap's and the range's locks, FaultNone means an access violation
+    fault_type fault(uint64_t vaddr, uint64_t error_code);
+    // Flushes the range from the TLB of every CPU that has the pagemap loaded and waits for them
+    void shootdown(uint64_t vaddr, uint64_t size);
     void deleteThis();
     void switchTo();
     void save();
@@ -157,15 +194,28 @@ struct mmap_range_global
     uint64_t length;
     int64_t offset;
 
-    void map_in_range(uint64_t vaddr, uint64_t paddr, int prot);
+    void map_in_range(uint64_t vaddr, uint64_t paddr, int prot, uint64_t length = page_size);
+
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr);
 };
 
 extern bool initialised;
 extern bool lvl5;
+// Pages around a fault that get mapped along with it, set with faultaround= on the command line
+extern size_t fault_around;
 extern Pagemap *kernel_pagemap;
 
+bool migrate_page(pmm::page_t *page, uint64_t newphys);
+
+// Page table pages below the top level allocated so far
+size_t tablepages();
+
 Pagemap *newPagemap();
 PTable *getPagemap();
 
+// Sets up the shootdown IPI, needs the APIC
+void shootdown_init();
+
 void init();
 }
\ No newline at end of file
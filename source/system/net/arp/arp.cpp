@@ -4,6 +4,7 @@
 #include <system/net/arp/arp.hpp>
 #include <lib/shared_ptr.hpp>
 #include <lib/memory.hpp>
+#include <lib/slab.hpp>
 #include <lib/log.hpp>
 
 namespace kernel::system::net::arp {
@@ -11,6 +12,8 @@ namespace kernel::system::net::arp {
 vector<tableEntry*> table;
 bool debug = NET_DEBUG;
 
+new_cache(entry_cache, tableEntry);
+
 tableEntry *table_add(macaddr mac, ipv4addr ip)
 {
     tableEntry *entry = new tableEntry;
@@ -38,6 +38,9 @@ struct tableEntry
 {
     macaddr mac;
     ipv4addr ip;
+
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr);
 };
 
 extern vector<tableEntry*> table;
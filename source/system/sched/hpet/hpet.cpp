@@ -17,6 +17,11 @@ uint64_t counter()
     return mminq(&hpet->main_counter_value);
 }
 
+uint64_t nanos()
+{
+    return static_cast<unsigned __int128>(counter()) * clk / 1000000;
+}
+
 void usleep(uint64_t us)
 {
     uint64_t target = counter() + (us * 1000000000) / clk;
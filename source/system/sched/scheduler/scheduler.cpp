@@ -9,6 +9,7 @@
 #include <lib/string.hpp>
 #include <lib/bitmap.hpp>
 #include <lib/timer.hpp>
+#include <lib/slab.hpp>
 #include <lib/log.hpp>
 
 using namespace kernel::system::cpu;
@@ -32,18 +33,23 @@ new_lock(thread_lock);
 new_lock(sched_lock);
 new_lock(proc_lock);
 
+new_cache(thread_cache, thread_t);
+new_cache(process_cache, process_t);
+
 int alloc_pid()
 {
-    if (pids.buffer == nullptr) pids.buffer = new uint8_t[(max_procs - 1) / 8 + 1];
-    for (size_t i = 1; i < max_procs; i++)
+    if (pids.buffer == nullptr)
     {
-        if (pids[i] == false)
-        {
-            pids.Set(i, true);
-            return i;
-        }
+        pids.buffer = new uint64_t[Bitmap::words(max_procs)]();
+        pids.summary = new uint64_t[Bitmap::words(Bitmap::words(max_procs))]();
+        pids.size = max_procs;
     }
-    return -1;
+
+    int64_t pid = pids.FindFirstClear(1);
+    if (pid == -1) return -1;
+
+    pids.Set(pid, true);
+    return pid;
 }
 
 void yield(uint64_t ms)
@@ -54,7 +60,11 @@ void yield(uint64_t ms)
 
 void idle()
 {
-    while (true) asm volatile ("hlt");
+    while (true)
+    {
+        pmm::refill_zeroed();
+        asm volatile ("hlt");
+    }
 }
 
 void func_wrapper(uint64_t addr, uint64_t args)
@@ -193,14 +203,21 @@ thread_t *thread_t::fork(registers_t *regs)
     auto newthread = new thread_t;
 
     newthread->state = INITIAL;
-    newthread->stack_phys = malloc<uint8_t*>(STACK_SIZE);
-    newthread->stack = newthread->stack_phys + hhdm_offset;
 
+    // The user stack is part of the forked pagemap and the kernel stack starts empty
     if (user)
     {
+        newthread->stack_phys = nullptr;
+        newthread->stack = this->stack;
+
         newthread->kstack_phys = malloc<uint8_t*>(STACK_SIZE);
         newthread->kstack = newthread->kstack_phys + hhdm_offset;
     }
+    else
+    {
+        newthread->stack_phys = malloc<uint8_t*>(STACK_SIZE);
+        newthread->stack = newthread->stack_phys + hhdm_offset;
+    }
 
     newthread->fpu_storage = malloc<uint8_t*>(this_cpu->fpu_storage_size) + hhdm_offset;
     newthread->fpu_storage_size = this->fpu_storage_size;
@@ -208,11 +225,14 @@ thread_t *thread_t::fork(registers_t *regs)
 
     newthread->regs = *regs;
 
-    uint64_t offset = reinterpret_cast<uint64_t>(newthread->stack) - reinterpret_cast<uint64_t>(this->stack);
-    newthread->regs.rsp += offset;
-    newthread->regs.rbp += offset;
+    if (!user)
+    {
+        uint64_t offset = reinterpret_cast<uint64_t>(newthread->stack) - reinterpret_cast<uint64_t>(this->stack);
+        newthread->regs.rsp += offset;
+        newthread->regs.rbp += offset;
 
-    memcpy(newthread->stack, this->stack, STACK_SIZE);
+        memcpy(newthread->stack, this->stack, STACK_SIZE);
+    }
 
     newthread->priority = this->priority;
     newthread->parent = this->parent;
@@ -499,7 +519,7 @@ void clean_proc(process_t *proc)
             // TODO: Fix this: Triple fault
             // free(thread->stack_phys);
             // if (thread->kstack_phys) free(thread->kstack_phys);
-            free(thread);
+            delete thread;
             thread_count--;
         }
         for (size_t i = 0; i < max_fds; i++)
@@ -520,7 +540,7 @@ void clean_proc(process_t *proc)
         }
         pids.Set(proc->pid, false);
         proc->pagemap->deleteThis();
-        free(proc);
+        delete proc;
         proc_count--;
     }
     else
@@ -535,7 +555,7 @@ void clean_proc(process_t *proc)
                 // TODO: Fix this: Triple fault
                 // free(thread->stack_phys);
                 // if (thread->kstack_phys) free(thread->kstack_phys);
-                free(thread);
+                delete thread;
                 thread_count--;
             }
         }
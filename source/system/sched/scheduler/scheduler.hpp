@@ -57,6 +57,10 @@ struct thread_t
 
     bool user;
 
+    // Last range Pagemap::find_range returned, valid while last_range_gen matches
+    vmm::mmap_range_local *last_range = nullptr;
+    uint64_t last_range_gen = 0;
+
     thread_t(process_t *parent, priority_t priority, Auxval auxval, vector<std::string> argv, vector<std::string> envp);
     thread_t(uint64_t addr, uint64_t args, process_t *parent, priority_t priority);
 
@@ -71,6 +75,9 @@ struct thread_t
     void block();
     void unblock();
     void exit(bool halt = true);
+
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr);
 };
 
 struct process_t
@@ -116,6 +123,9 @@ struct process_t
     void unblock();
     void exit(bool halt = true);
 
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr);
+
     private:
 };
 
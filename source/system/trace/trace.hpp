@@ -19,6 +19,8 @@ struct symtable_t
     std::string name;
 };
 
+symtable_t lookup(uint64_t addr);
+
 void trace(bool terminal);
 void init();
 }
\ No newline at end of file
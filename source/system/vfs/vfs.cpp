@@ -3,6 +3,7 @@
 #include <system/sched/scheduler/scheduler.hpp>
 #include <system/vfs/vfs.hpp>
 #include <lib/lock.hpp>
+#include <lib/slab.hpp>
 #include <lib/log.hpp>
 
 using namespace kernel::system::sched;
@@ -17,6 +18,9 @@ vector<filesystem_t*> filesystems;
 
 new_lock(vfs_lock);
 
+new_cache(fs_node_cache, fs_node_t);
+new_cache(handle_cache, handle_t);
+
 static uint64_t dev_id = 1;
 uint64_t dev_new_id()
 {
@@ -164,6 +164,8 @@ struct resource_t
     int refcount;
     lock_t lock;
     bool can_mmap;
+    // Frames returned by mmap hold a page cache reference
+    bool cached = false;
 
     virtual int64_t read(void *handle, uint8_t *buffer, uint64_t offset, uint64_t size)
     {
@@ -204,6 +206,22 @@ struct resource_t
         errno_set(EINVAL);
         return nullptr;
     }
+    // Bytes the page cache covers, a disk may not fit in stat.size
+    virtual uint64_t length()
+    {
+        return this->stat.size;
+    }
+    // Used by the page cache, size never crosses a page
+    virtual bool readpage(uint64_t offset, uint8_t *buffer, uint64_t size)
+    {
+        errno_set(EIO);
+        return false;
+    }
+    virtual bool writepage(uint64_t offset, uint8_t *buffer, uint64_t size)
+    {
+        errno_set(EIO);
+        return false;
+    }
 };
 
 struct fs_node_t;
@@ -236,6 +254,8 @@ struct handle_t
     {
         return this->res->ioctl(this, request, argp);
     }
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr);
 };
 
 struct fd_t
@@ -297,6 +317,9 @@ struct fs_node_t
     fs_node_t *redir;
 
     void dotentries(fs_node_t *parent);
+
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr);
 };
 
 extern bool initialised;